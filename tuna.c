@@ -7,25 +7,67 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <time.h>
 #include <math.h>
 #include <unistd.h>
 #include <pwd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
 #include <libgen.h>
 #include <sys/stat.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 /* Defines */
 
 #define TUNA_VERSION "0.2.1"
 #define TUNA_TAB_STOP 4
 #define TUNA_QUIT_TIMES 3
+#define TUNA_GAP_MIN 16
+#define TUNA_RENDER_CACHE 4096
+#define TUNA_BUFFER_CACHE (4 * TUNA_RENDER_CACHE)
+/* Mapped files are not copied; see handleSigBus for one that shrinks on disk */
+#define TUNA_MMAP_THRESHOLD (64 << 20)
+#define TUNA_LOAD_ASYNC (1 << 20)
+#define TUNA_LOAD_CHUNK (4 << 20)
+#define TUNA_LOAD_FIRST (64 << 10)
+#define TUNA_HL_IDLE_ROWS 20000
+#define TUNA_HL_CHUNK 2048
+#define TUNA_HL_THREADS 64
+#define TUNA_SEARCH_MAX (1 << 22)
+#define TUNA_SEARCH_BATCH 1024
+#define TUNA_FRAME_MS 16
+#define TUNA_ESC_MS 50
+#define TUNA_STATUS_SECS 5
+#define TUNA_SAVE_IOV 512
+#ifndef TUNA_FSYNC
+#define TUNA_FSYNC 1
+#endif
+#ifndef TUNA_UNDO_CAP
+#define TUNA_UNDO_CAP (64 << 20)
+#endif
+#define TUNA_UNDO_BLOCK (64 << 10)
+#define TUNA_UNDO_ADOPT 4096
+#define TUNA_JOURNAL_MS 1000
+#define TUNA_JOURNAL_BATCH (1 << 20)
+#define TUNA_JOURNAL_COMPACT (8 << 20)
+#define TUNA_STATS_FILE "tuna-stats.txt"
+#define TUNA_TRACE_EVENTS (1 << 16)
+#define TUNA_TRACE_TRACKS 64
 
 #define CTRL_KEY(k) ((k) & 0x1f) 
 
@@ -40,6 +82,8 @@ enum editorKey{
     END_KEY,
     PAGE_UP,
     PAGE_DOWN,
+    SEARCH_PROGRESS,
+    PASTE_KEY,
 };
 
 enum editorHighlight{
@@ -54,11 +98,28 @@ enum editorHighlight{
     HL_MATCH,
 };
 
+enum undoType{
+    UNDO_INSERT,
+    UNDO_DELETE,
+};
+
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+#define UNDO_SEAL  (1<<0)
+#define UNDO_ADOPT (1<<1)
+#define UNDO_EOF   (1<<2)
+
+#define SCREEN_INVERSE 0x80
+
 /* Data */
 
+struct editorKeyword{
+    const char *word;
+    int len;
+    int hl;
+};
+
 struct editorSyntax{
     char *filetype;
     char **filematch;
@@ -67,36 +128,383 @@ struct editorSyntax{
     char *multiline_comment_start;
     char *multiline_comment_end;
     int flags;
+    struct editorKeyword *kw_table;
+    unsigned int kw_mask;
+    int kw_min;
+    int kw_max;
 };
 
-typedef struct erow{
-    int idx;
-    int size;
+/*
+ * Highlighting is kept as runs of one class over the rendered columns.
+ * Only runs that aren't HL_NORMAL are stored, in column order, each as the
+ * count of normal columns since the previous run and its own length. Runs
+ * too long for len are split, and a gap too long for skip is bridged with
+ * empty HL_NORMAL spans.
+ */
+typedef struct hlSpan{
+    unsigned short skip;
+    unsigned char len;
+    unsigned char hl;
+}hlSpan;
+
+/*
+ * A drawn row's render and highlight live in one erowCache block. Rows
+ * without tabs render straight from chars, so the block only carries a
+ * copy of the text for rows that have tabs (or an open gap). Only rows
+ * near the screen have a cache, which keeps the erow itself to 24 bytes.
+ */
+typedef struct erowCache{
     int rsize;
-    char *chars;
+    int nspan;
     char *render;
-    unsigned char *hl;
-    int hl_open_comment;
+    hlSpan span[];
+}erowCache;
+
+typedef struct erow{
+    char *chars;
+    erowCache *cache;
+    int size;
+    unsigned char hl_open_comment;
+    char hl_dirty;
+    char mapped;
 }erow;
 
-struct editorConfig{
+#define ROWS_PER_LEAF 64
+#define ROWS_PER_NODE 32
+#define ROW_LEAF_MAPPED 2
+
+struct rowNode{
+    int leaf;
+    int n;
+    int count;
+    struct rowInner *parent;
+};
+
+typedef struct rowLeaf{
+    struct rowNode h;
+    struct rowLeaf *prev;
+    struct rowLeaf *next;
+    int cached;
+    erow rows[ROWS_PER_LEAF];
+}rowLeaf;
+
+typedef struct rowMapLeaf{
+    struct rowNode h;
+    struct rowLeaf *prev;
+    struct rowLeaf *next;
+    int cached;
+    size_t base;
+    uint64_t open_comment;
+    uint64_t hl_dirty;
+    uint32_t nl[ROWS_PER_LEAF];
+}rowMapLeaf;
+
+typedef struct rowInner{
+    struct rowNode h;
+    struct rowNode *child[ROWS_PER_NODE];
+}rowInner;
+
+typedef struct searchMatch{
+    int row;
+    int col;
+}searchMatch;
+
+struct searchSpan{
+    struct rowLeaf *leaf;
+    int base;
+};
+
+struct searchCursor{
+    int cx;
+    int rx;
+};
+
+struct editorSearch{
+    char *query;
+    int len;
+    int icase;
+    int anchor_row;
+    int anchor_col;
+    int current;
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    searchMatch *m;
+    int n;
+    int cap;
+    int done;
+    int complete;
+    int capped;
+    int seen;
+    pthread_t thread;
+    int running;
+    int cancel;
+    struct searchSpan *snap;
+    int nsnap;
+    int capsnap;
+    int rows;
+    int last;
+    const char *map;
+    searchMatch *src;
+    int nsrc;
+    searchMatch batch[TUNA_SEARCH_BATCH];
+    int nbatch;
+    long long woken;
+    struct rowLeaf *retired;
+};
+
+typedef struct screenCell{
+    char ch;
+    unsigned char attr;
+}screenCell;
+
+struct editorScreen{
+    int rows;
+    int cols;
+    screenCell *cur;
+    screenCell *prev;
+    int valid;
+    int rowoff;
+    int cy;
+    int cx;
+    int allocs;
+    int frame_allocs;
+    int frame_bytes;
+};
+
+/*
+ * Undo history. Record text lives in an append-only arena of blocks; a
+ * block is freed once no record points into it. Pastes big enough to be
+ * worth it hand their buffer over instead (block == NULL). Records in
+ * [0, pos) can be undone, [pos, n) redone. An insert with eof set also
+ * created the row at the end of the file it went into, so undoing it takes
+ * that row out again. saved is the pos that matches the file on disk, or
+ * -1 once that state can't be reached any more.
+ */
+typedef struct undoBlock{
+    int refs;
+    int used;
+    int size;
+    char data[];
+}undoBlock;
+
+typedef struct undoRecord{
+    char type;
+    char reverse;
+    char sealed;
+    char eof;
+    int row;
+    int col;
+    int len;
+    char *text;
+    undoBlock *block;
+}undoRecord;
+
+struct editorUndo{
+    undoRecord *rec;
+    int n;
+    int cap;
+    int pos;
+    int saved;
+    undoBlock *cur;
+    long long bytes;
+};
+
+struct editorLoad{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;
+    size_t size;
+    size_t loaded;
+    rowLeaf *first;
+    rowLeaf *last;
+    int done;
+    int err;
+    int cancel;
+    long long woken;
+    long long start;
+};
+
+/*
+ * A long stretch of never lexed rows is highlighted in chunks on a pool of
+ * threads. Every chunk but the first is lexed as if it started outside a
+ * comment; a sequential fix-up then relexes the ones that did not.
+ */
+struct lexChunk{
+    rowLeaf *leaf;
+    int off;
+    int rows;
+    int entry;
+    int exit;
+};
+
+struct editorLexPool{
+    pthread_t thread[TUNA_HL_THREADS];
+    int n;
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    unsigned int gen;
+    int pending;
+    struct lexChunk *chunk;
+    int nchunk;
+    int next;
+};
+
+/*
+ * Latency histograms in microseconds, HDR style: exact below STAT_SUB,
+ * then STAT_SUB buckets per power of two, so every value is kept to
+ * within 1/STAT_SUB of itself without any allocation.
+ */
+#define STAT_SUB_BITS 4
+#define STAT_SUB (1 << STAT_SUB_BITS)
+#define STAT_BUCKETS (STAT_SUB * 34)
+
+typedef struct statHist{
+    const char *name;
+    long long count;
+    long long sum;
+    long long max;
+    uint32_t bucket[STAT_BUCKETS];
+}statHist;
+
+struct editorStats{
+    statHist latency;
+    statHist keypress;
+    statHist syntax;
+    statHist draw;
+    statHist write;
+    statHist frame;
+    long long key_at;
+    long long key_start;
+    long long keys;
+    long long frames;
+    long long bytes;
+    long long relexed;
+    long long allocs;
+    int overlay;
+};
+
+/*
+ * With TUNA_TRACE set, spans are kept in a ring of the last
+ * TUNA_TRACE_EVENTS and written out as Chrome trace events. Any thread
+ * can record: a slot is claimed with one atomic add and published by its
+ * sequence number, so the oldest spans are simply overwritten.
+ */
+typedef struct traceEvent{
+    uint64_t seq;
+    const char *cat;
+    const char *name;
+    const char *arg;
+    long long value;
+    long long ts;
+    long long dur;
+    int tid;
+}traceEvent;
+
+struct editorTrace{
+    char *path;
+    traceEvent *ring;
+    uint64_t head;
+    pthread_mutex_t lock;
+    char tracks[TUNA_TRACE_TRACKS][16];
+    int ntracks;
+    int save_tid;
+};
+
+struct journalHeader{
+    char magic[8];
+    long long size;
+    long long mtime;
+    long long mtime_nsec;
+};
+
+struct editorJournal{
+    char *path;
+    int fd;
+    int off;
+    char *buf;
+    int len;
+    int cap;
+    char run;
+    char run_nl;
+    int run_row;
+    int run_col;
+    int run_len;
+    char *run_text;
+    int run_cap;
+    long long since;
+    long long size;
+    long long compact_at;
+    long long save_from;
+    pid_t compact_pid;
+    int compact_fd;
+    char *compact_tmp;
+    long long compact_from;
+};
+
+/*
+ * Everything that belongs to one open file lives in an editorBuffer, and
+ * B points at the one being edited. The rest of editorConfig is shared by
+ * all buffers: the terminal, the screen, search and the save in flight.
+ * Other buffers stay resident with their rows, caches and history, so
+ * switching back to one costs nothing but a redraw.
+ */
+struct editorBuffer{
     int cx, cy;
     int rx;
     int rowoff;
     int coloff;
-    int screenrows;
-    int screencols;
     int numrows;
-    erow *row;
+    struct rowNode *root;
+    rowLeaf *cache_leaf;
+    int cache_start;
+    erow *gap_row;
+    int gap_start;
+    int gap_len;
+    int cached_rows;
+    int hl_valid;
+    int hl_lexed;
+    int hl_dirty;
+    char *map;
+    size_t map_len;
+    int map_heap;
+    struct editorLoad *load;
+    struct editorUndo undo;
+    struct editorJournal journal;
     int dirty;
     char *filename;
+    struct editorSyntax *syntax;
+    long long used;
+};
+
+struct editorConfig{
+    struct editorBuffer **buffers;
+    int nbuffers;
+    long long tick;
+    int screenrows;
+    int screencols;
+    struct editorSearch search;
+    struct editorScreen screen;
+    struct editorLexPool lex;
+    struct editorStats stats;
+    struct editorTrace trace;
+    int wake[2];
+    volatile sig_atomic_t resized;
+    pid_t save_pid;
+    int save_fd;
+    int save_dirty;
+    int save_undo;
+    struct editorBuffer *save_buf;
+    int batch;
     char statusmsg[80];
     time_t statusmsg_time;
-    struct editorSyntax *syntax;
     struct termios orig_termios;
 };
 
 struct editorConfig E;
+struct editorBuffer *B;
 
 /* Filetypes */
 
@@ -192,23 +600,29 @@ char *ASM_HL_keywords[] = {
 
 struct editorSyntax HLDB[] = {
     {
-        "C",
-        C_HL_extensions,
-	C_HL_keywords,
-	"//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        .filetype = "C",
+        .filematch = C_HL_extensions,
+        .keywords = C_HL_keywords,
+        .singleline_comment_start = "//",
+        .multiline_comment_start = "/*",
+        .multiline_comment_end = "*/",
+        .flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
     },{
-        "Python",
-        PY_HL_extensions,
-        PY_HL_keywords,
-        "#", "'''", "'''",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        .filetype = "Python",
+        .filematch = PY_HL_extensions,
+        .keywords = PY_HL_keywords,
+        .singleline_comment_start = "#",
+        .multiline_comment_start = "'''",
+        .multiline_comment_end = "'''",
+        .flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
     },{
-        "Assembly",
-        ASM_HL_extensions,
-        ASM_HL_keywords,
-        ";", ";", ";",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        .filetype = "Assembly",
+        .filematch = ASM_HL_extensions,
+        .keywords = ASM_HL_keywords,
+        .singleline_comment_start = ";",
+        .multiline_comment_start = ";",
+        .multiline_comment_end = ";",
+        .flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
     },
 };
 
@@ -218,9 +632,40 @@ struct editorSyntax HLDB[] = {
 
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
+void initEditor();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
-void editorSavePrompt();
 char *editorPromptInput();
+void editorFreeRow(erow *row);
+void editorRowDropCache(int filerow);
+void editorRowEvict(int keep_from, int keep_to);
+void editorGapClose();
+int editorSyntaxIdle();
+int editorSearchPoll(struct editorSearch *s);
+void editorScreenInvalidate();
+int getWindowSize(int *rows, int *cols);
+void editorSaveReap();
+void editorSaveWait();
+void editorUndoInsert(int row, int col, char *s, int len, int flags);
+void editorUndoDelete(int row, int col, char c);
+void editorUndoClear();
+void journalInsert(int row, int col, char *s, int len);
+void journalDelete(int row, int col, int len);
+int journalTimeout();
+void journalFlush();
+void journalSaved();
+void journalDiscard();
+void journalCompactPoll();
+void editorMapFaultPoll();
+void journalRecover();
+struct editorBuffer *bufferNew();
+void bufferSwitch(struct editorBuffer *b);
+void bufferFree(struct editorBuffer *b);
+struct editorBuffer *bufferFind(const char *path);
+int editorLoadPoll();
+void editorLoadWait(int row);
+void editorLoadCancel(struct editorBuffer *b);
+void editorSearchReset(struct editorSearch *s);
+void editorSearchExtend(struct editorSearch *s, struct rowLeaf *first, int last);
 
 /* Terminal */
 
@@ -233,6 +678,7 @@ void die(const char *s){
 }
 
 void disableRawMode(){
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1){
         die("tcsetattr");
     }
@@ -248,36 +694,227 @@ void enableRawMode(){
     raw.c_cflag |= (CS8);
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 
     if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+/*
+ * Input is read in blocks and decoded from a buffer, so a burst of keys or
+ * an escape sequence costs one read() instead of one per byte. Bracketed
+ * paste is turned on in raw mode; everything between the paste markers is
+ * collected into input_paste and handed back as a single PASTE_KEY.
+ *
+ * Reads never block. Waiting happens in editorWait, a poll() on stdin and
+ * a self-pipe that the SIGWINCH handler and background threads write to,
+ * with a timeout taken from whatever is due next: idle highlighting, or
+ * the status message running out. With nothing due it sleeps until input
+ * or a wakeup arrives.
+ */
+
+#define WAIT_INPUT  (1<<0)
+#define WAIT_REDRAW (1<<1)
+#define WAIT_WAKE   (1<<2)
+
+long long editorClockMs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+long long editorClockUs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void editorWake(){
+    int saved = errno;
+    if(E.wake[1] > 0) write(E.wake[1], "w", 1);
+    errno = saved;
+}
+
+static void handleSigWinch(int sig){
+    (void)sig;
+    E.resized = 1;
+    editorWake();
+}
+
+/* A journal compaction finished; journalCompactPoll reaps it. */
+static void handleSigChld(int sig){
+    (void)sig;
+    editorWake();
+}
+
+void editorInitEvents(){
+    E.save_fd = -1;
+    if(pipe(E.wake) == -1) die("pipe");
+    for(int i = 0; i < 2; i++){
+        fcntl(E.wake[i], F_SETFL, fcntl(E.wake[i], F_GETFL) | O_NONBLOCK);
+        fcntl(E.wake[i], F_SETFD, FD_CLOEXEC);
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleSigWinch;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sa, NULL);
+    sa.sa_handler = handleSigChld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+}
+
+static int statusTimeout(){
+    if(E.statusmsg[0] == '\0') return -1;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long left = (E.statusmsg_time + TUNA_STATUS_SECS - ts.tv_sec) * 1000LL - ts.tv_nsec / 1000000;
+    return left < 0 ? -1 : (int)left + 1;
+}
+
+int editorWait(int timeout){
+    struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0}, {E.wake[0], POLLIN, 0}, {E.save_fd, POLLIN, 0}};
+    int events = 0;
+    if(poll(fds, 3, timeout) == -1){
+        if(errno != EINTR) die("poll");
+        fds[0].revents = fds[1].revents = fds[2].revents = 0;
+    }
+    if(fds[0].revents) events |= WAIT_INPUT;
+    if(fds[1].revents){
+        char buf[64];
+        while(read(E.wake[0], buf, sizeof(buf)) > 0);
+        journalCompactPoll();
+        editorMapFaultPoll();
+        events |= WAIT_WAKE;
+    }
+    if(fds[2].revents){
+        editorSaveReap();
+        events |= WAIT_REDRAW;
+    }
+    if(E.resized){
+        E.resized = 0;
+        if(getWindowSize(&E.screenrows, &E.screencols) == 0) E.screenrows -= 2;
+        editorScreenInvalidate();
+        events |= WAIT_REDRAW;
+    }
+    return events;
+}
+
+static char input_buf[4096];
+static int input_len, input_pos;
+static char *input_paste;
+static int input_paste_len, input_paste_cap;
+
+static int inputFill(){
+    if(input_pos > 0){
+        memmove(input_buf, &input_buf[input_pos], input_len - input_pos);
+        input_len -= input_pos;
+        input_pos = 0;
+    }
+    if(input_len == sizeof(input_buf)) return 0;
+    int nread = read(STDIN_FILENO, &input_buf[input_len], sizeof(input_buf) - input_len);
+    if(nread == -1 && errno != EAGAIN) die("read");
+    if(nread <= 0) return 0;
+    input_len += nread;
+    return nread;
+}
+
+static int inputByte(char *c, int timeout){
+    if(input_pos == input_len){
+        if(timeout && !(editorWait(timeout) & WAIT_INPUT)) return 0;
+        if(inputFill() == 0) return 0;
+    }
+    *c = input_buf[input_pos++];
+    return 1;
+}
+
+int editorInputPending(){
+    return input_pos < input_len;
+}
+
+static void inputPasteAppend(const char *s, int len){
+    if(input_paste_len + len > input_paste_cap){
+        while(input_paste_len + len > input_paste_cap) input_paste_cap = input_paste_cap ? input_paste_cap * 2 : 4096;
+        input_paste = realloc(input_paste, input_paste_cap);
+        if(input_paste == NULL) die("realloc");
+    }
+    memcpy(&input_paste[input_paste_len], s, len);
+    input_paste_len += len;
+}
+
+static int editorReadPaste(){
+    static const char end[] = "\x1b[201~";
+    int idle = 0;
+    input_paste_len = 0;
+    while(1){
+        char *at = &input_buf[input_pos];
+        int avail = input_len - input_pos;
+        char *stop = memmem(at, avail, end, 6);
+        if(stop){
+            inputPasteAppend(at, stop - at);
+            input_pos += stop - at + 6;
+            break;
+        }
+        /* Hold back a possible partial end marker until more arrives. */
+        int take = avail > 5 ? avail - 5 : 0;
+        inputPasteAppend(at, take);
+        input_pos += take;
+        if((!(editorWait(100) & WAIT_INPUT) || inputFill() == 0) && ++idle == 10){
+            inputPasteAppend(&input_buf[input_pos], input_len - input_pos);
+            input_pos = input_len;
+            break;
+        }
+    }
+    return PASTE_KEY;
 }
 
 int editorReadKey(){
-    int nread;
     char c;
-    while((nread = read(STDIN_FILENO, &c, 1)) != 1){
-        if(nread == -1 && errno != EAGAIN) die("read");
+    int busy = 1;
+    while(!inputByte(&c, 0)){
+        if(editorSearchPoll(&E.search)) return SEARCH_PROGRESS;
+        if(editorLoadPoll()){
+            busy = 1;
+            editorRefreshScreen();
+        }
+        int timeout = busy ? 0 : statusTimeout();
+        int flush = journalTimeout();
+        if(flush >= 0 && (timeout < 0 || flush < timeout)) timeout = flush;
+        int events = editorWait(timeout);
+        if(events == 0){
+            if(journalTimeout() == 0) journalFlush();
+            if(busy) busy = editorSyntaxIdle();
+            else events |= WAIT_REDRAW;
+        }
+        if(events & WAIT_REDRAW) editorRefreshScreen();
     }
+    E.stats.key_start = editorClockUs();
+    if(E.stats.key_at == 0) E.stats.key_at = E.stats.key_start;
 
     if(c == '\x1b'){
         char seq[3];
 
-        if(read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if(read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+        if(!inputByte(&seq[0], TUNA_ESC_MS)) return '\x1b';
+        if(!inputByte(&seq[1], TUNA_ESC_MS)) return '\x1b';
 
         if(seq[0] == '['){
             if(seq[1] >= '0' && seq[1] <= '9'){
-                if(read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+                int n = seq[1] - '0';
+                while(1){
+                    if(!inputByte(&seq[2], TUNA_ESC_MS)) return '\x1b';
+                    if(seq[2] < '0' || seq[2] > '9') break;
+                    n = n * 10 + seq[2] - '0';
+                }
                 if(seq[2] == '~'){
-                    switch(seq[1]){
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
+                    switch(n){
+                        case 1: return HOME_KEY;
+                        case 3: return DEL_KEY;
+                        case 4: return END_KEY;
+                        case 5: return PAGE_UP;
+                        case 6: return PAGE_DOWN;
+                        case 7: return HOME_KEY;
+                        case 8: return END_KEY;
+                        case 200: return editorReadPaste();
                     }
                 }
             }else{
@@ -309,6 +946,8 @@ int getCursorPosition(int *rows, int *cols){
     if(write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
     while(i < sizeof(buf) - 1){
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if(poll(&pfd, 1, 1000) != 1) break;
         if(read(STDIN_FILENO, &buf[i], 1) != 1) break;
         if(buf[i] == 'R') break;
         i++;
@@ -317,7 +956,7 @@ int getCursorPosition(int *rows, int *cols){
 
     if(buf[0] != '\x1b' || buf[1] != '[') return -1;
     if(sscanf(&buf[2], "%d;%d", rows, cols) != 2) return -1;
-    int max_lines = E.numrows;
+    int max_lines = B->numrows;
     int max_digits = max_lines > 0 ? (int)log10(max_lines) + 1 : 1;
     *cols -= (max_digits + 1);
 
@@ -338,366 +977,2241 @@ int getWindowSize(int *rows, int *cols){
     }
 }
 
-/* Syntax Highlighing */
+/* Stats */
 
-int is_separator(int c){
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}", c) != NULL;
+static int statIndex(long long v){
+    if(v < STAT_SUB) return v < 0 ? 0 : v;
+    int e = 63 - __builtin_clzll(v);
+    int i = (e - STAT_SUB_BITS + 1) * STAT_SUB + ((v >> (e - STAT_SUB_BITS)) & (STAT_SUB - 1));
+    return i < STAT_BUCKETS ? i : STAT_BUCKETS - 1;
 }
 
-void editorUpdateSyntax(erow *row){
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
-
-    if(E.syntax == NULL) return;
-
-    char **keywords = E.syntax->keywords;
-
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
-
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
-
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
-
-    int i = 0;
-    while(i < row->rsize){
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-
-		if(scs_len && !in_string && !in_comment){
-		    if(!strncmp(&row->render[i], scs, scs_len)){
-				memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-				break;
-		    }
-		}
-
-		if(mcs_len && mce_len && !in_string){
-		    if(in_comment){
-				row->hl[i] = HL_MLCOMMENT;
-				if(!strncmp(&row->render[i], mce, mce_len)){
-				    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-				    i += mce_len;
-				    in_comment = 0;
-				    prev_sep = 1;
-				    continue;
-				}else{
-				    i++;
-				    continue;
-				}
-		    }else if(!strncmp(&row->render[i], mcs, mcs_len)){
-				memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-				i += mcs_len;
-				in_comment = 1;
-				continue;
-		    }
-		}
+/* Largest value that lands in bucket i */
+static long long statBucketMax(int i){
+    i++;
+    if(i < STAT_SUB) return i - 1;
+    int e = i / STAT_SUB + STAT_SUB_BITS - 1;
+    return ((long long)(STAT_SUB + i % STAT_SUB) << (e - STAT_SUB_BITS)) - 1;
+}
 
-		if(E.syntax->flags & HL_HIGHLIGHT_STRINGS){
-		    if(in_string){
-		        row->hl[i] = HL_STRING;
-			if(c == '\\' && i + 1 < row->rsize){
-			    row->hl[i + 1] = HL_STRING;
-			    i += 2;
-			    continue;
-			}
-			if(c == in_string) in_string = 0;
-			i++;
-			prev_sep = 1;
-			continue;
-	    }else{
-			if(c == '"' || c == '\''){
-			    in_string = c;
-			    row->hl[i] = HL_STRING;
-			    i++;
-			    continue;
-			}
-	    }
-	}
+void statAdd(statHist *h, long long us){
+    h->bucket[statIndex(us)]++;
+    h->count++;
+    h->sum += us;
+    if(us > h->max) h->max = us;
+}
 
-	if(E.syntax->flags & HL_HIGHLIGHT_NUMBERS){
- 		if((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)){
-			row->hl[i] = HL_NUMBER;
-            i++;
-            prev_sep = 0;
-            continue;
-        }
-	}
+long long statPercentile(statHist *h, double q){
+    if(h->count == 0) return 0;
+    long long want = (long long)(q * h->count + 0.999999), seen = 0;
+    if(want < 1) want = 1;
+    for(int i = 0; i < STAT_BUCKETS; i++){
+        seen += h->bucket[i];
+        if(seen >= want) return statBucketMax(i) < h->max ? statBucketMax(i) : h->max;
+    }
+    return h->max;
+}
 
-	if(prev_sep){
-	    int j;
-	    for(j = 0; keywords[j]; j++){
-			int klen = strlen(keywords[j]);
-			int kw2 = keywords[j][klen - 1] == '|';
-			if(kw2) klen--;
-			int kw3 = keywords[j][klen - 1] == '$';
-			if(kw3) klen--;
-
-			if(!strncmp(&row->render[i], keywords[j], klen) && is_separator(row->render[i + klen])){
-			    memset(&row->hl[i], kw3 ? HL_KEYWORD3 : (kw2 ? HL_KEYWORD2 : HL_KEYWORD1) , klen);
-			    i += klen;
-		 		break;
-			}
-	    }
-	    
-		if(keywords[j] != NULL){
-			prev_sep = 0;
-			continue;
-	    }
-	}
+void editorStatsInit(){
+    struct editorStats *st = &E.stats;
+    st->latency.name = "keystroke to paint";
+    st->keypress.name = "editorProcessKeypress";
+    st->syntax.name = "editorUpdateSyntax";
+    st->draw.name = "editorDrawRows";
+    st->write.name = "write";
+    st->frame.name = "editorRefreshScreen";
+}
 
-        prev_sep = is_separator(c);
-        i++;
+static void statDump(FILE *fp, statHist *h){
+    fprintf(fp, "\n%s: %lld samples", h->name, h->count);
+    if(h->count == 0){
+        fputc('\n', fp);
+        return;
+    }
+    fprintf(fp, ", mean %.3f ms, max %.3f ms\n", (double)h->sum / h->count / 1000.0, h->max / 1000.0);
+    fprintf(fp, "  p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f ms\n", statPercentile(h, 0.5) / 1000.0,
+            statPercentile(h, 0.9) / 1000.0, statPercentile(h, 0.99) / 1000.0, statPercentile(h, 0.999) / 1000.0);
+    long long seen = 0;
+    for(int i = 0; i < STAT_BUCKETS; i++){
+        if(h->bucket[i] == 0) continue;
+        seen += h->bucket[i];
+        fprintf(fp, "  <= %10.3f ms %10u %7.3f%%\n", statBucketMax(i) / 1000.0, h->bucket[i], seen * 100.0 / h->count);
     }
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if(changed && row->idx + 1 < E.numrows)
-	editorUpdateSyntax(&E.row[row->idx + 1]);
 }
 
-int editorSyntaxToColor(int hl){
-    switch(hl){
-		case HL_COMMENT:
-		case HL_MLCOMMENT: return 91;	// 36 - Cyan
-		case HL_KEYWORD1: return 93;	// 33 - Yellow
-		case HL_KEYWORD2: return 94;	// 32 - Green
-		case HL_KEYWORD3: return 32;
-        case HL_STRING: return 31;		// 35 - Magenta
-        case HL_NUMBER: return 96;		// 31 - Red
-        case HL_MATCH: return 34;		// 34 - Blue
-        default: return 37;				// 37 - White
+/* Writes every histogram and counter to TUNA_STATS_FILE. */
+void editorStatsDump(){
+    struct editorStats *st = &E.stats;
+    FILE *fp = fopen(TUNA_STATS_FILE, "w");
+    if(!fp){
+        editorSetStatusMessage("Can't write %s: %s", TUNA_STATS_FILE, strerror(errno));
+        return;
     }
+    fprintf(fp, "tuna %s stats\n", TUNA_VERSION);
+    fprintf(fp, "keys %lld, frames %lld, bytes written %lld, rows relexed %lld\n",
+            st->keys, st->frames, st->bytes, st->relexed);
+    fprintf(fp, "allocations: %lld render cache, %d output path\n", st->allocs, E.screen.allocs);
+    statHist *all[] = {&st->latency, &st->keypress, &st->syntax, &st->draw, &st->write, &st->frame};
+    for(unsigned int i = 0; i < sizeof(all) / sizeof(all[0]); i++) statDump(fp, all[i]);
+    fclose(fp);
+    editorSetStatusMessage("Stats written to %s", TUNA_STATS_FILE);
 }
 
-/*/
-	COLORS LIST
-	- 30 - Black
-	- 31 - Red
-	- 32 - Green
-	- 33 - Yellow ( shitty )
-	- 34 - Blue
-	- 35 - Magenta
-	- 36 - Cyan
-	- 37 - White
-
-	BOLD COLOR LIST
-	- 90 - 97 - Same color (better sometimes) but bold
-/*/
-
-
-void editorSelectSyntaxHighlight(){
-    E.syntax = NULL;
-    if(E.filename == NULL) return;
-
-    char *ext = strrchr(E.filename, '.');
-
-    for(unsigned int j = 0; j < HLDB_ENTRIES; j++){
-        struct editorSyntax *s = &HLDB[j];
-        unsigned int i = 0;
-        while(s->filematch[i]){
-            int is_ext = (s->filematch[i][0] == '.');
-            if((is_ext && ext && !strcmp(ext, s->filematch[i])) || (!is_ext && strstr(E.filename, s->filematch[i]))){
-                E.syntax = s;
-
-                int filerow;
-                for(filerow = 0; filerow < E.numrows; filerow++){
-                    editorUpdateSyntax(&E.row[filerow]);
-                }
-
-                return;
-            }
-        i++;
-        }
+/* Trace */
+
+static __thread int trace_tid;
+
+/* Track id for name, shared by every thread that asks for the same name. */
+int traceTrack(const char *name){
+    struct editorTrace *t = &E.trace;
+    if(t->ring == NULL) return 0;
+    pthread_mutex_lock(&t->lock);
+    int id;
+    for(id = 0; id < t->ntracks; id++)
+        if(!strcmp(t->tracks[id], name)) break;
+    if(id == t->ntracks && t->ntracks < TUNA_TRACE_TRACKS){
+        snprintf(t->tracks[id], sizeof(t->tracks[id]), "%s", name);
+        t->ntracks++;
     }
+    pthread_mutex_unlock(&t->lock);
+    return id + 1;
 }
 
-/* Row Operations */
+void traceThread(const char *name){
+    trace_tid = traceTrack(name);
+}
 
-int editorRowCxToRx(erow *row, int cx){
-    int rx = 0;
-    int j;
-    for(j = 0; j < cx; j++){
-        if(row->chars[j] == '\t')
-            rx += (TUNA_TAB_STOP - 1) - (rx % TUNA_TAB_STOP);
-        rx++;
-    }
-    return rx;
+void traceRecord(int tid, const char *cat, const char *name, long long start, long long end, const char *arg, long long value){
+    struct editorTrace *t = &E.trace;
+    if(t->ring == NULL) return;
+    uint64_t n = __atomic_fetch_add(&t->head, 1, __ATOMIC_RELAXED);
+    traceEvent *ev = &t->ring[n & (TUNA_TRACE_EVENTS - 1)];
+    __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&ev->cat, cat, __ATOMIC_RELAXED);
+    __atomic_store_n(&ev->name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&ev->arg, arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&ev->value, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&ev->ts, start, __ATOMIC_RELAXED);
+    __atomic_store_n(&ev->dur, end - start, __ATOMIC_RELAXED);
+    __atomic_store_n(&ev->tid, tid, __ATOMIC_RELAXED);
+    __atomic_store_n(&ev->seq, n + 1, __ATOMIC_RELEASE);
 }
-int editorRowRxToCx(erow *row, int rx){
-    int cur_rx = 0;
-    int cx;
-    for(cx = 0; cx < row->size; cx++){
-        if(row->chars[cx] == '\t')
-            cur_rx += (TUNA_TAB_STOP - 1) - (cur_rx % TUNA_TAB_STOP);
-        cur_rx++;
 
-        if(cur_rx > rx) return cx;
+/* Records a span from start until now on the calling thread's track. */
+void traceSpan(const char *cat, const char *name, long long start, const char *arg, long long value){
+    if(E.trace.ring == NULL) return;
+    if(trace_tid == 0) traceThread("thread");
+    traceRecord(trace_tid, cat, name, start, editorClockUs(), arg, value);
+}
+
+/* Writes whatever the ring still holds to the TUNA_TRACE file. */
+void traceFlush(){
+    struct editorTrace *t = &E.trace;
+    if(t->ring == NULL) return;
+    FILE *fp = fopen(t->path, "w");
+    if(!fp) return;
+
+    int pid = getpid();
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"tuna\"}}", pid);
+    pthread_mutex_lock(&t->lock);
+    for(int i = 0; i < t->ntracks; i++)
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", pid, i + 1, t->tracks[i]);
+    pthread_mutex_unlock(&t->lock);
+
+    uint64_t head = __atomic_load_n(&t->head, __ATOMIC_RELAXED);
+    uint64_t n = head > TUNA_TRACE_EVENTS ? head - TUNA_TRACE_EVENTS : 0;
+    for(; n < head; n++){
+        traceEvent *ev = &t->ring[n & (TUNA_TRACE_EVENTS - 1)], e;
+        uint64_t seq = __atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE);
+        if(seq != n + 1) continue;
+        e.cat = __atomic_load_n(&ev->cat, __ATOMIC_RELAXED);
+        e.name = __atomic_load_n(&ev->name, __ATOMIC_RELAXED);
+        e.arg = __atomic_load_n(&ev->arg, __ATOMIC_RELAXED);
+        e.value = __atomic_load_n(&ev->value, __ATOMIC_RELAXED);
+        e.ts = __atomic_load_n(&ev->ts, __ATOMIC_RELAXED);
+        e.dur = __atomic_load_n(&ev->dur, __ATOMIC_RELAXED);
+        e.tid = __atomic_load_n(&ev->tid, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&ev->seq, __ATOMIC_RELAXED) != seq) continue;
+
+        fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d",
+                e.name, e.cat, e.ts, e.dur, pid, e.tid);
+        if(e.arg) fprintf(fp, ",\"args\":{\"%s\":%lld}", e.arg, e.value);
+        fputc('}', fp);
     }
-    return cx;
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
 }
 
-void editorUpdateRow(erow *row){
-    int tabs = 0;
-    int j;
-    for(j = 0; j < row->size; j++)
-        if(row->chars[j] == '\t') tabs++;
+void traceInit(){
+    struct editorTrace *t = &E.trace;
+    char *path = getenv("TUNA_TRACE");
+    if(path == NULL || *path == '\0') return;
+    t->ring = calloc(TUNA_TRACE_EVENTS, sizeof(traceEvent));
+    if(t->ring == NULL) return;
+    t->path = strdup(path);
+    pthread_mutex_init(&t->lock, NULL);
+    traceThread("main");
+    t->save_tid = traceTrack("save");
+    atexit(traceFlush);
+}
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(TUNA_TAB_STOP - 1) + 1);
+/* Row Store */
+
+/*
+ * Rows live in a counted B+ tree: leaves hold runs of erows, inner nodes
+ * hold the row count of every subtree, so lookups, inserts and deletes by
+ * line number are O(log n) and a line's index is its position in the tree.
+ *
+ * Files opened through mmap start out as mapped leaves, which only keep
+ * the newline offsets of their lines. A mapped leaf is turned into a
+ * normal one the first time any of its rows is looked up.
+ */
+
+static rowLeaf *rowStoreMaterialize(rowLeaf *leaf);
+
+static rowLeaf *rowStoreFind(int at, int *off, int inserting){
+    rowLeaf *c = B->cache_leaf;
+    if(c){
+        int end = B->cache_start + c->h.n;
+        if(at >= B->cache_start && (at < end || (inserting && at == end))){
+            *off = at - B->cache_start;
+            return c;
+        }
+        if(c->next && at >= end && at < end + c->next->h.n){
+            B->cache_leaf = rowStoreMaterialize(c->next);
+            B->cache_start = end;
+            *off = at - end;
+            return B->cache_leaf;
+        }
+    }
 
-    int idx = 0;
-    for(j = 0; j<row->size; j++){
-        if(row->chars[j] == '\t'){
-            row->render[idx++] = ' ';
-            while(idx % TUNA_TAB_STOP != 0) row->render[idx++] = ' ';
-        }else{
-            row->render[idx++] = row->chars[j];
+    struct rowNode *node = B->root;
+    if(node == NULL) return NULL;
+
+    int base = 0;
+    while(!node->leaf){
+        rowInner *in = (rowInner *)node;
+        int i;
+        for(i = 0; i < in->h.n - 1; i++){
+            if(at < in->child[i]->count) break;
+            at -= in->child[i]->count;
+            base += in->child[i]->count;
         }
+        node = in->child[i];
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
 
-    editorUpdateSyntax(row);
+    B->cache_leaf = rowStoreMaterialize((rowLeaf *)node);
+    B->cache_start = base;
+    *off = at;
+    return B->cache_leaf;
 }
 
-void editorInsertRow(int at, char *s, size_t len){
-    if(at < 0 || at > E.numrows) return;
-
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    for(int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
-
-    E.row[at].idx = at;
+erow *editorRowAt(int at){
+    if(at < 0 || at >= B->numrows) return NULL;
+    int off;
+    rowLeaf *leaf = rowStoreFind(at, &off, 0);
+    return &leaf->rows[off];
+}
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+static int rowInnerSum(rowInner *in){
+    int count = 0;
+    for(int i = 0; i < in->h.n; i++) count += in->child[i]->count;
+    return count;
+}
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+static void rowNodeRecount(rowInner *in){
+    for(; in; in = in->h.parent) in->h.count = rowInnerSum(in);
+}
 
-    E.numrows++;
-    E.dirty++;
+static int rowNodeSlot(struct rowNode *node){
+    rowInner *p = node->parent;
+    int i;
+    for(i = 0; p->child[i] != node; i++);
+    return i;
 }
 
-void editorFreeRow(erow *row){
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+static char *rowMapLine(rowMapLeaf *ml, int i, int *len){
+    size_t start = ml->base + (i ? ml->nl[i - 1] + 1 : 0);
+    size_t end = ml->base + ml->nl[i];
+    while(end > start && B->map[end - 1] == '\r') end--;
+    *len = end - start;
+    return &B->map[start];
+}
+
+static rowLeaf *rowStoreMaterialize(rowLeaf *leaf){
+    if(leaf->h.leaf != ROW_LEAF_MAPPED) return leaf;
+
+    rowMapLeaf *ml = (rowMapLeaf *)leaf;
+    rowLeaf *nl = calloc(1, sizeof(rowLeaf));
+    nl->h = ml->h;
+    nl->h.leaf = 1;
+    nl->prev = ml->prev;
+    nl->next = ml->next;
+    if(nl->prev) nl->prev->next = nl;
+    if(nl->next) nl->next->prev = nl;
+    if(nl->h.parent) nl->h.parent->child[rowNodeSlot(&ml->h)] = &nl->h;
+    else B->root = &nl->h;
+
+    for(int i = 0; i < nl->h.n; i++){
+        erow *row = &nl->rows[i];
+        row->chars = rowMapLine(ml, i, &row->size);
+        row->mapped = 1;
+        row->hl_open_comment = (ml->open_comment >> i) & 1;
+        row->hl_dirty = (ml->hl_dirty >> i) & 1;
+    }
+    if(E.search.running){
+        ml->prev = E.search.retired;
+        E.search.retired = (rowLeaf *)ml;
+    }else{
+        free(ml);
+    }
+    return nl;
+}
+
+char *rowStoreLine(rowLeaf *leaf, int i, int *len){
+    if(leaf->h.leaf == ROW_LEAF_MAPPED) return rowMapLine((rowMapLeaf *)leaf, i, len);
+    *len = leaf->rows[i].size;
+    return leaf->rows[i].chars;
+}
+
+int rowLeafState(rowLeaf *leaf, int i){
+    if(leaf->h.leaf == ROW_LEAF_MAPPED) return (((rowMapLeaf *)leaf)->open_comment >> i) & 1;
+    return leaf->rows[i].hl_open_comment;
+}
+
+void rowLeafSetState(rowLeaf *leaf, int i, int state){
+    if(leaf->h.leaf == ROW_LEAF_MAPPED){
+        rowMapLeaf *ml = (rowMapLeaf *)leaf;
+        ml->open_comment = (ml->open_comment & ~(1ULL << i)) | ((uint64_t)(state != 0) << i);
+    }else{
+        leaf->rows[i].hl_open_comment = state;
+    }
+}
+
+int rowLeafDirty(rowLeaf *leaf, int i){
+    if(leaf->h.leaf == ROW_LEAF_MAPPED) return (((rowMapLeaf *)leaf)->hl_dirty >> i) & 1;
+    return leaf->rows[i].hl_dirty;
+}
+
+void rowLeafSetDirty(rowLeaf *leaf, int i, int dirty){
+    if(leaf->h.leaf == ROW_LEAF_MAPPED){
+        rowMapLeaf *ml = (rowMapLeaf *)leaf;
+        ml->hl_dirty = (ml->hl_dirty & ~(1ULL << i)) | ((uint64_t)(dirty != 0) << i);
+    }else{
+        leaf->rows[i].hl_dirty = dirty;
+    }
+}
+
+void rowLeafDropCache(rowLeaf *leaf, int i){
+    if(leaf->h.leaf == ROW_LEAF_MAPPED) return;
+    erow *row = &leaf->rows[i];
+    if(row->cache == NULL) return;
+    free(row->cache);
+    row->cache = NULL;
+    leaf->cached--;
+    B->cached_rows--;
+}
+
+static void rowNodeInsertAfter(struct rowNode *node, struct rowNode *sib){
+    rowInner *p = node->parent;
+
+    if(p == NULL){
+        p = calloc(1, sizeof(rowInner));
+        p->h.n = 2;
+        p->child[0] = node;
+        p->child[1] = sib;
+        node->parent = sib->parent = p;
+        B->root = &p->h;
+        rowNodeRecount(p);
+        return;
+    }
+
+    if(p->h.n == ROWS_PER_NODE){
+        rowInner *q = calloc(1, sizeof(rowInner));
+        int half = p->h.n / 2;
+        q->h.n = p->h.n - half;
+        memcpy(q->child, &p->child[half], sizeof(q->child[0]) * q->h.n);
+        for(int i = 0; i < q->h.n; i++) q->child[i]->parent = q;
+        p->h.n = half;
+        p->h.count = rowInnerSum(p);
+        q->h.count = rowInnerSum(q);
+        rowNodeInsertAfter(&p->h, &q->h);
+        p = node->parent;
+    }
+
+    int i = rowNodeSlot(node) + 1;
+    memmove(&p->child[i + 1], &p->child[i], sizeof(p->child[0]) * (p->h.n - i));
+    p->child[i] = sib;
+    p->h.n++;
+    sib->parent = p;
+    rowNodeRecount(p);
+}
+
+static void rowNodeRemove(struct rowNode *node);
+
+static void rowInnerMerge(rowInner *in){
+    rowInner *p = in->h.parent;
+    if(p == NULL){
+        if(in->h.n == 1){
+            B->root = in->child[0];
+            B->root->parent = NULL;
+            free(in);
+        }
+        return;
+    }
+    if(in->h.n >= ROWS_PER_NODE / 4 || p->h.n < 2) return;
+
+    int i = rowNodeSlot(&in->h);
+    rowInner *left = (i > 0) ? (rowInner *)p->child[i - 1] : in;
+    rowInner *right = (i > 0) ? in : (rowInner *)p->child[i + 1];
+    if(left->h.n + right->h.n > ROWS_PER_NODE) return;
+
+    for(int j = 0; j < right->h.n; j++){
+        right->child[j]->parent = left;
+        left->child[left->h.n++] = right->child[j];
+    }
+    left->h.count += right->h.count;
+    right->h.n = 0;
+    right->h.count = 0;
+    rowNodeRemove(&right->h);
+}
+
+static void rowNodeRemove(struct rowNode *node){
+    rowInner *p = node->parent;
+    if(node->leaf){
+        rowLeaf *leaf = (rowLeaf *)node;
+        if(leaf->prev) leaf->prev->next = leaf->next;
+        if(leaf->next) leaf->next->prev = leaf->prev;
+    }
+    if(p == NULL){
+        free(node);
+        B->root = NULL;
+        return;
+    }
+
+    int i = rowNodeSlot(node);
+    free(node);
+    memmove(&p->child[i], &p->child[i + 1], sizeof(p->child[0]) * (p->h.n - i - 1));
+    p->h.n--;
+    if(p->h.n == 0){
+        rowNodeRemove(&p->h);
+    }else{
+        rowNodeRecount(p);
+        rowInnerMerge(p);
+    }
+}
+
+erow *rowStoreInsert(int at){
+    int off;
+    rowLeaf *leaf;
+
+    if(B->root == NULL){
+        leaf = calloc(1, sizeof(rowLeaf));
+        leaf->h.leaf = 1;
+        B->root = &leaf->h;
+        B->cache_leaf = leaf;
+        B->cache_start = 0;
+        off = 0;
+    }else{
+        leaf = rowStoreFind(at, &off, 1);
+    }
+
+    if(leaf->h.n == ROWS_PER_LEAF){
+        rowLeaf *nl = calloc(1, sizeof(rowLeaf));
+        int half = leaf->h.n / 2;
+        nl->h.leaf = 1;
+        nl->h.n = leaf->h.n - half;
+        nl->h.count = nl->h.n;
+        memcpy(nl->rows, &leaf->rows[half], sizeof(erow) * nl->h.n);
+        leaf->h.n = half;
+        leaf->h.count = half;
+        for(int i = 0; i < nl->h.n; i++) if(nl->rows[i].cache) nl->cached++;
+        leaf->cached -= nl->cached;
+
+        nl->prev = leaf;
+        nl->next = leaf->next;
+        if(leaf->next) leaf->next->prev = nl;
+        leaf->next = nl;
+        rowNodeInsertAfter(&leaf->h, &nl->h);
+
+        if(off > half){
+            B->cache_start += half;
+            off -= half;
+            leaf = nl;
+        }
+        B->cache_leaf = leaf;
+    }
+
+    memmove(&leaf->rows[off + 1], &leaf->rows[off], sizeof(erow) * (leaf->h.n - off));
+    leaf->h.n++;
+    leaf->h.count++;
+    for(rowInner *p = leaf->h.parent; p; p = p->h.parent) p->h.count++;
+
+    memset(&leaf->rows[off], 0, sizeof(erow));
+    return &leaf->rows[off];
+}
+
+void rowStoreDelete(int at){
+    int off;
+    rowLeaf *leaf = rowStoreFind(at, &off, 0);
+    if(leaf == NULL) return;
+
+    memmove(&leaf->rows[off], &leaf->rows[off + 1], sizeof(erow) * (leaf->h.n - off - 1));
+    leaf->h.n--;
+    leaf->h.count--;
+    for(rowInner *p = leaf->h.parent; p; p = p->h.parent) p->h.count--;
+
+    if(leaf->h.n >= ROWS_PER_LEAF / 4) return;
+    B->cache_leaf = NULL;
+
+    rowInner *p = leaf->h.parent;
+    if(leaf->h.n == 0 || p == NULL){
+        if(leaf->h.n == 0) rowNodeRemove(&leaf->h);
+        return;
+    }
+    if(p->h.n < 2) return;
+
+    int i = rowNodeSlot(&leaf->h);
+    rowLeaf *left = (i > 0) ? (rowLeaf *)p->child[i - 1] : leaf;
+    rowLeaf *right = (i > 0) ? leaf : (rowLeaf *)p->child[i + 1];
+    if(left->h.leaf == ROW_LEAF_MAPPED || right->h.leaf == ROW_LEAF_MAPPED) return;
+    if(left->h.n + right->h.n > ROWS_PER_LEAF) return;
+
+    memcpy(&left->rows[left->h.n], right->rows, sizeof(erow) * right->h.n);
+    left->h.n += right->h.n;
+    left->h.count = left->h.n;
+    left->cached += right->cached;
+    right->h.n = 0;
+    right->h.count = 0;
+    rowNodeRemove(&right->h);
+}
+
+static void rowNodeFree(struct rowNode *node){
+    if(node->leaf == 1){
+        rowLeaf *leaf = (rowLeaf *)node;
+        for(int i = 0; i < leaf->h.n; i++) editorFreeRow(&leaf->rows[i]);
+    }else if(!node->leaf){
+        rowInner *in = (rowInner *)node;
+        for(int i = 0; i < in->h.n; i++) rowNodeFree(in->child[i]);
+    }
+    free(node);
+}
+
+void rowStoreClear(){
+    if(B->root) rowNodeFree(B->root);
+    B->root = NULL;
+    B->cache_leaf = NULL;
+    B->numrows = 0;
+    B->cached_rows = 0;
+}
+
+void rowStoreCount(int at, int delta){
+    int off;
+    rowLeaf *leaf = rowStoreFind(at, &off, 0);
+    leaf->cached += delta;
+    B->cached_rows += delta;
+}
+
+rowLeaf *rowStoreSeek(int at, int *off){
+    struct rowNode *node = B->root;
+    if(node == NULL || at >= node->count) return NULL;
+    while(!node->leaf){
+        rowInner *in = (rowInner *)node;
+        int i;
+        for(i = 0; i < in->h.n - 1; i++){
+            if(at < in->child[i]->count) break;
+            at -= in->child[i]->count;
+        }
+        node = in->child[i];
+    }
+    *off = at;
+    return (rowLeaf *)node;
+}
+
+rowLeaf *rowStoreFirst(){
+    struct rowNode *node = B->root;
+    if(node == NULL) return NULL;
+    while(!node->leaf) node = ((rowInner *)node)->child[0];
+    return (rowLeaf *)node;
+}
+
+void rowStoreBuild(rowLeaf *first){
+    int n = 0, cap = 64;
+    struct rowNode **level = malloc(sizeof(*level) * cap);
+    for(rowLeaf *leaf = first; leaf; leaf = leaf->next){
+        if(n == cap){
+            cap *= 2;
+            level = realloc(level, sizeof(*level) * cap);
+        }
+        level[n++] = &leaf->h;
+    }
+
+    while(n > 1){
+        int m = 0;
+        for(int i = 0; i < n; i += ROWS_PER_NODE){
+            rowInner *in = calloc(1, sizeof(rowInner));
+            for(int j = i; j < n && j < i + ROWS_PER_NODE; j++){
+                in->child[in->h.n++] = level[j];
+                in->h.count += level[j]->count;
+                level[j]->parent = in;
+            }
+            level[m++] = &in->h;
+        }
+        n = m;
+    }
+
+    B->root = n ? level[0] : NULL;
+    B->cache_leaf = NULL;
+    B->numrows = n ? B->root->count : 0;
+    free(level);
+}
+
+/* Hangs a chain of finished leaves off the end of the tree. */
+void rowStoreAppend(rowLeaf *first){
+    if(B->root == NULL){
+        rowStoreBuild(first);
+        return;
+    }
+    struct rowNode *node = B->root;
+    while(!node->leaf) node = ((rowInner *)node)->child[((rowInner *)node)->h.n - 1];
+    rowLeaf *tail = (rowLeaf *)node;
+    for(rowLeaf *leaf = first, *next; leaf; leaf = next){
+        next = leaf->next;
+        tail->next = leaf;
+        leaf->prev = tail;
+        rowNodeInsertAfter(&tail->h, &leaf->h);
+        B->numrows += leaf->h.n;
+        tail = leaf;
+    }
+}
+
+/* Syntax Highlighing */
+
+int is_separator(int c){
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}", c) != NULL;
+}
+
+/*
+ * Keyword lists are compiled once per filetype into an open addressing
+ * hash table, with the "|" and "$" suffixes already decoded into their
+ * highlight class. Keywords never contain separators, so a keyword can
+ * only ever match a whole token, and the lexer does one lookup per token
+ * instead of comparing against every entry in the list.
+ */
+
+static unsigned char separator_table[256];
+
+static uint32_t editorKeywordHash(const char *s, int len){
+    uint32_t h = 2166136261u;
+    for(int i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+void editorSyntaxCompile(struct editorSyntax *s){
+    if(!separator_table[0])
+        for(int c = 0; c < 256; c++) separator_table[c] = is_separator(c);
+    if(s->kw_table) return;
+
+    unsigned int n = 0;
+    while(s->keywords[n]) n++;
+    unsigned int size = 16;
+    while(size < n * 2) size *= 2;
+
+    s->kw_table = calloc(size, sizeof(struct editorKeyword));
+    s->kw_mask = size - 1;
+    s->kw_min = INT32_MAX;
+    s->kw_max = 0;
+
+    for(unsigned int j = 0; j < n; j++){
+        char *kw = s->keywords[j];
+        int klen = strlen(kw);
+        int kw2 = kw[klen - 1] == '|';
+        if(kw2) klen--;
+        int kw3 = kw[klen - 1] == '$';
+        if(kw3) klen--;
+
+        unsigned int slot = editorKeywordHash(kw, klen) & s->kw_mask;
+        while(s->kw_table[slot].word){
+            if(s->kw_table[slot].len == klen && !memcmp(s->kw_table[slot].word, kw, klen)) break;
+            slot = (slot + 1) & s->kw_mask;
+        }
+        if(s->kw_table[slot].word) continue;    /* the first entry in the list wins */
+
+        s->kw_table[slot].word = kw;
+        s->kw_table[slot].len = klen;
+        s->kw_table[slot].hl = kw3 ? HL_KEYWORD3 : (kw2 ? HL_KEYWORD2 : HL_KEYWORD1);
+        if(klen < s->kw_min) s->kw_min = klen;
+        if(klen > s->kw_max) s->kw_max = klen;
+    }
+}
+
+static int editorKeywordLookup(struct editorSyntax *s, const char *tok, int len){
+    if(len < s->kw_min || len > s->kw_max) return HL_NORMAL;
+    unsigned int slot = editorKeywordHash(tok, len) & s->kw_mask;
+    while(s->kw_table[slot].word){
+        if(s->kw_table[slot].len == len && !memcmp(s->kw_table[slot].word, tok, len)) return s->kw_table[slot].hl;
+        slot = (slot + 1) & s->kw_mask;
+    }
+    return HL_NORMAL;
+}
+
+/*
+ * Highlighting is lazy and incremental: spans are only built for rows
+ * that get drawn. Each row keeps its exit state in hl_open_comment.
+ * Rows below B->hl_valid have an up to date state, rows from B->hl_lexed on
+ * have never been lexed, and in between only rows flagged hl_dirty (edited,
+ * or whose entry state changed) need relexing. A sync walks forward from
+ * B->hl_valid and stops relexing as soon as the exit states match the
+ * stored ones again, so an edit costs what it actually changes. Whatever
+ * is left below the screen is caught up from editorSyntaxIdle.
+ */
+
+struct hlOut{
+    hlSpan *span;
+    int n;
+    int end;
+    unsigned char hl;
+};
+
+/* Colours [start, start + len), merging with the run it continues */
+static inline void hlEmit(struct hlOut *o, int start, int len, int hl){
+    int gap = start - (o->end > 0 ? o->end : 0);
+    int joins = gap == 0 && o->hl == hl;
+    o->end = start + len;
+    o->hl = hl;
+    if(o->span == NULL) return;
+    if(joins && o->n > 0){
+        hlSpan *last = &o->span[o->n - 1];
+        int take = UCHAR_MAX - last->len;
+        if(take > len) take = len;
+        last->len += take;
+        len -= take;
+    }
+    while(gap > USHRT_MAX){
+        o->span[o->n++] = (hlSpan){USHRT_MAX, 0, HL_NORMAL};
+        gap -= USHRT_MAX;
+    }
+    while(len > 0){
+        int take = len > UCHAR_MAX ? UCHAR_MAX : len;
+        o->span[o->n++] = (hlSpan){gap, take, hl};
+        gap = 0;
+        len -= take;
+    }
+}
+
+/*
+ * Lexes one row of text entering in in_comment and returns the exit state.
+ * The spans go to span, which must have room for len of them, and their
+ * count to *nspan; passing NULL only works out the state.
+ */
+int editorSyntaxLex(char *text, int len, hlSpan *span, int *nspan, int in_comment){
+    struct hlOut o = {span, 0, -1, HL_NORMAL};
+    if(nspan) *nspan = 0;
+
+    if(B->syntax == NULL) return 0;
+
+    char *scs = B->syntax->singleline_comment_start;
+    char *mcs = B->syntax->multiline_comment_start;
+    char *mce = B->syntax->multiline_comment_end;
+
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    int prev_sep = 1;
+    int in_string = 0;
+
+    int i = 0;
+    while(i < len){
+        char c = text[i];
+        unsigned char prev_hl = (o.end == i) ? o.hl : HL_NORMAL;
+
+		if(scs_len && !in_string && !in_comment){
+		    if(scs_len <= len - i && !strncmp(&text[i], scs, scs_len)){
+				hlEmit(&o, i, len - i, HL_COMMENT);
+				break;
+		    }
+		}
+
+		if(mcs_len && mce_len && !in_string){
+		    if(in_comment){
+				if(mce_len <= len - i && !strncmp(&text[i], mce, mce_len)){
+				    hlEmit(&o, i, mce_len, HL_MLCOMMENT);
+				    i += mce_len;
+				    in_comment = 0;
+				    prev_sep = 1;
+				    continue;
+				}else{
+				    hlEmit(&o, i, 1, HL_MLCOMMENT);
+				    i++;
+				    continue;
+				}
+		    }else if(mcs_len <= len - i && !strncmp(&text[i], mcs, mcs_len)){
+				hlEmit(&o, i, mcs_len, HL_MLCOMMENT);
+				i += mcs_len;
+				in_comment = 1;
+				continue;
+		    }
+		}
+
+		if(B->syntax->flags & HL_HIGHLIGHT_STRINGS){
+		    if(in_string){
+			if(c == '\\' && i + 1 < len){
+			    hlEmit(&o, i, 2, HL_STRING);
+			    i += 2;
+			    continue;
+			}
+		        hlEmit(&o, i, 1, HL_STRING);
+			if(c == in_string) in_string = 0;
+			i++;
+			prev_sep = 1;
+			continue;
+	    }else{
+			if(c == '"' || c == '\''){
+			    in_string = c;
+			    hlEmit(&o, i, 1, HL_STRING);
+			    i++;
+			    continue;
+			}
+	    }
+	}
+
+	if(B->syntax->flags & HL_HIGHLIGHT_NUMBERS){
+ 		if((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)){
+			hlEmit(&o, i, 1, HL_NUMBER);
+            i++;
+            prev_sep = 0;
+            continue;
+        }
+	}
+
+	if(prev_sep){
+	    int klen = 0;
+	    while(i + klen < len && !separator_table[(unsigned char)text[i + klen]]) klen++;
+
+	    int kw = editorKeywordLookup(B->syntax, &text[i], klen);
+	    if(kw != HL_NORMAL){
+			hlEmit(&o, i, klen, kw);
+			i += klen;
+			prev_sep = 0;
+			continue;
+	    }
+	}
+
+        prev_sep = separator_table[(unsigned char)c];
+        i++;
+    }
+    if(nspan) *nspan = o.n;
+    return in_comment;
+}
+
+static void editorSyntaxMark(rowLeaf *leaf, int off, int filerow){
+    rowLeafDropCache(leaf, off);
+    if(filerow < B->hl_lexed && !rowLeafDirty(leaf, off)){
+        rowLeafSetDirty(leaf, off, 1);
+        B->hl_dirty++;
+    }
+    if(filerow < B->hl_valid) B->hl_valid = filerow;
+}
+
+void editorSyntaxInvalidate(int filerow){
+    int off;
+    rowLeaf *leaf = rowStoreFind(filerow, &off, 0);
+    if(leaf && filerow < B->numrows) editorSyntaxMark(leaf, off, filerow);
+    else if(filerow < B->hl_valid) B->hl_valid = filerow;
+}
+
+static void editorSyntaxCommit(rowLeaf *leaf, int off, int filerow, int state){
+    if(rowLeafDirty(leaf, off)){
+        rowLeafSetDirty(leaf, off, 0);
+        if(filerow < B->hl_lexed) B->hl_dirty--;
+    }
+
+    if(filerow >= B->hl_lexed){
+        B->hl_lexed = filerow + 1;
+    }else if(rowLeafState(leaf, off) != state && filerow + 1 < B->numrows){
+        if(off + 1 < leaf->h.n) editorSyntaxMark(leaf, off + 1, filerow + 1);
+        else editorSyntaxMark(leaf->next, 0, filerow + 1);
+    }
+
+    rowLeafSetState(leaf, off, state);
+    if(B->hl_valid == filerow) B->hl_valid++;
+}
+
+static int editorSyntaxEntry(int filerow){
+    int off = 0;
+    rowLeaf *leaf = (filerow > 0) ? rowStoreSeek(filerow - 1, &off) : NULL;
+    return leaf ? rowLeafState(leaf, off) : 0;
+}
+
+/*
+ * Lex one chunk, storing each row's exit state. In a fix-up the stored
+ * states came from a wrong entry state, and once a row ends up in the state
+ * it already has the rest of the chunk is right as it stands.
+ */
+static int lexChunkRun(struct lexChunk *c, int fixup){
+    rowLeaf *leaf = c->leaf;
+    int off = c->off;
+    int state = c->entry;
+
+    for(int i = 0; i < c->rows; i++){
+        int len;
+        char *text = rowStoreLine(leaf, off, &len);
+        state = editorSyntaxLex(text, len, NULL, NULL, state);
+        if(fixup && rowLeafState(leaf, off) == state) return i + 1;
+        rowLeafSetState(leaf, off, state);
+        if(rowLeafDirty(leaf, off)) rowLeafSetDirty(leaf, off, 0);
+        if(++off == leaf->h.n){
+            leaf = leaf->next;
+            off = 0;
+        }
+    }
+    c->exit = state;
+    return c->rows;
+}
+
+static void lexDrain(struct editorLexPool *p){
+    for(;;){
+        int k = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+        if(k >= p->nchunk) return;
+        long long start = editorClockUs();
+        int rows = lexChunkRun(&p->chunk[k], 0);
+        traceSpan("highlight", "lexChunk", start, "rows", rows);
+    }
+}
+
+static void *lexWorker(void *arg){
+    struct editorLexPool *p = arg;
+    unsigned int gen = 0;
+
+    static int workers = 0;
+    char name[16];
+    snprintf(name, sizeof(name), "lex %d", __atomic_add_fetch(&workers, 1, __ATOMIC_RELAXED));
+    traceThread(name);
+    pthread_mutex_lock(&p->lock);
+    for(;;){
+        while(p->gen == gen) pthread_cond_wait(&p->work, &p->lock);
+        gen = p->gen;
+        pthread_mutex_unlock(&p->lock);
+
+        lexDrain(p);
+
+        pthread_mutex_lock(&p->lock);
+        if(--p->pending == 0) pthread_cond_signal(&p->done);
+    }
+    return NULL;
+}
+
+/* Threads available for lexing, the main thread included */
+int editorLexThreads(){
+    struct editorLexPool *p = &E.lex;
+    if(!p->started){
+        p->started = 1;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if(cpus > TUNA_HL_THREADS) cpus = TUNA_HL_THREADS;
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->work, NULL);
+        pthread_cond_init(&p->done, NULL);
+        for(p->n = 0; p->n < cpus - 1; p->n++)
+            if(pthread_create(&p->thread[p->n], NULL, lexWorker, p) != 0) break;
+    }
+    return p->n + 1;
+}
+
+/*
+ * Lex rows [from, upto), none of which has been lexed before, starting in
+ * state. The main thread takes chunks along with the pool, and the rows are
+ * left alone by everything else until the pass returns.
+ */
+static void editorSyntaxParallel(rowLeaf *leaf, int off, int from, int upto, int state){
+    static struct lexChunk *chunk = NULL;
+    static int cap = 0;
+
+    struct editorLexPool *p = &E.lex;
+    int threads = editorLexThreads();
+    int per = (upto - from) / (threads * 4);
+    if(per < TUNA_HL_CHUNK) per = TUNA_HL_CHUNK;
+
+    if(B->gap_row) editorGapClose();
+
+    /* Chunks end on leaf boundaries so no two threads share a leaf */
+    int n = 0;
+    int filerow = from;
+    while(filerow < upto){
+        if(n == cap){
+            cap = cap ? cap * 2 : 64;
+            chunk = realloc(chunk, sizeof(struct lexChunk) * cap);
+        }
+        struct lexChunk *c = &chunk[n++];
+        c->leaf = leaf;
+        c->off = off;
+        c->rows = 0;
+        c->entry = 0;
+        while(filerow < upto && c->rows < per){
+            int take = leaf->h.n - off;
+            if(take > upto - filerow) take = upto - filerow;
+            for(int i = off; leaf->cached && i < off + take; i++) rowLeafDropCache(leaf, i);
+            c->rows += take;
+            filerow += take;
+            off += take;
+            if(off == leaf->h.n){
+                leaf = leaf->next;
+                off = 0;
+            }
+        }
+    }
+    chunk[0].entry = state;
+
+    p->chunk = chunk;
+    p->nchunk = n;
+    p->next = 0;
+    int wake = n > 1 && p->n > 0;
+    if(wake){
+        pthread_mutex_lock(&p->lock);
+        p->pending = p->n;
+        p->gen++;
+        pthread_cond_broadcast(&p->work);
+        pthread_mutex_unlock(&p->lock);
+    }
+    lexDrain(p);
+    if(wake){
+        pthread_mutex_lock(&p->lock);
+        while(p->pending) pthread_cond_wait(&p->done, &p->lock);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    for(int k = 1; k < n; k++){
+        if(chunk[k - 1].exit == chunk[k].entry) continue;
+        chunk[k].entry = chunk[k - 1].exit;
+        E.stats.relexed += lexChunkRun(&chunk[k], 1);
+    }
+    E.stats.relexed += upto - from;
+
+    B->hl_lexed = B->hl_valid = upto;
+}
+
+void editorSyntaxSync(int upto){
+    if(upto > B->numrows) upto = B->numrows;
+    if(B->syntax == NULL){
+        if(B->hl_valid < upto) B->hl_valid = upto;
+        return;
+    }
+    if(B->hl_valid >= upto) return;
+
+    long long start = editorClockUs();
+    long long relexed = E.stats.relexed;
+    int off;
+    int filerow = B->hl_valid;
+    rowLeaf *leaf = rowStoreSeek(filerow, &off);
+    int state = editorSyntaxEntry(filerow);
+
+    while(filerow < upto){
+        if(filerow >= B->hl_lexed && upto - filerow >= 2 * TUNA_HL_CHUNK && editorLexThreads() > 1){
+            editorSyntaxParallel(leaf, off, filerow, upto, state);
+            break;
+        }
+        if(filerow >= B->hl_lexed || rowLeafDirty(leaf, off)){
+            if(leaf->h.leaf != ROW_LEAF_MAPPED){
+                if(&leaf->rows[off] == B->gap_row) editorGapClose();
+                rowLeafDropCache(leaf, off);
+            }
+            int len;
+            char *text = rowStoreLine(leaf, off, &len);
+            state = editorSyntaxLex(text, len, NULL, NULL, state);
+            E.stats.relexed++;
+            editorSyntaxCommit(leaf, off, filerow, state);
+        }else if(B->hl_dirty == 0){
+            /* Nothing is left to relex before the unlexed tail */
+            filerow = B->hl_valid = B->hl_lexed;
+            if(filerow >= upto) break;
+            leaf = rowStoreSeek(filerow, &off);
+            state = editorSyntaxEntry(filerow);
+            continue;
+        }else{
+            state = rowLeafState(leaf, off);
+            if(B->hl_valid == filerow) B->hl_valid++;
+        }
+
+        filerow++;
+        if(++off == leaf->h.n){
+            leaf = leaf->next;
+            off = 0;
+        }
+    }
+    if(E.stats.relexed > relexed) traceSpan("highlight", "editorSyntaxSync", start, "rows", E.stats.relexed - relexed);
+}
+
+int editorSyntaxIdle(){
+    if(B->syntax && B->hl_valid < B->numrows){
+        /* The unlexed tail goes to the pool, so it can take a bigger step */
+        int rows = TUNA_HL_IDLE_ROWS;
+        if(B->hl_dirty == 0) rows *= editorLexThreads();
+        editorSyntaxSync(B->hl_valid + rows);
+    }
+    return B->syntax && B->hl_valid < B->numrows;
+}
+
+/* Lexes filerow's render text, returning its spans in a scratch buffer */
+hlSpan *editorUpdateSyntax(int filerow, char *render, int rsize, int *nspan){
+    static hlSpan *scratch = NULL;
+    static int scratch_len = 0;
+
+    long long start = editorClockUs();
+    int off;
+    if(rsize > scratch_len){
+        scratch_len = rsize;
+        scratch = realloc(scratch, sizeof(hlSpan) * scratch_len);
+    }
+    editorSyntaxSync(filerow);
+    int state = editorSyntaxLex(render, rsize, scratch, nspan, editorSyntaxEntry(filerow));
+    E.stats.relexed++;
+    rowLeaf *leaf = rowStoreFind(filerow, &off, 0);
+    editorSyntaxCommit(leaf, off, filerow, state);
+    statAdd(&E.stats.syntax, editorClockUs() - start);
+    return scratch;
+}
+
+int editorSyntaxToColor(int hl){
+    switch(hl){
+		case HL_COMMENT:
+		case HL_MLCOMMENT: return 91;	// 36 - Cyan
+		case HL_KEYWORD1: return 93;	// 33 - Yellow
+		case HL_KEYWORD2: return 94;	// 32 - Green
+		case HL_KEYWORD3: return 32;
+        case HL_STRING: return 31;		// 35 - Magenta
+        case HL_NUMBER: return 96;		// 31 - Red
+        case HL_MATCH: return 34;		// 34 - Blue
+        default: return 37;				// 37 - White
+    }
+}
+
+/*/
+	COLORS LIST
+	- 30 - Black
+	- 31 - Red
+	- 32 - Green
+	- 33 - Yellow ( shitty )
+	- 34 - Blue
+	- 35 - Magenta
+	- 36 - Cyan
+	- 37 - White
+
+	BOLD COLOR LIST
+	- 90 - 97 - Same color (better sometimes) but bold
+/*/
+
+
+void editorSelectSyntaxHighlight(){
+    long long start = editorClockUs();
+    if(B->syntax){
+        editorRowEvict(0, 0);
+        B->hl_valid = B->hl_lexed = B->hl_dirty = 0;
+    }
+    B->syntax = NULL;
+    if(B->filename == NULL) return;
+
+    char *ext = strrchr(B->filename, '.');
+
+    for(unsigned int j = 0; j < HLDB_ENTRIES; j++){
+        struct editorSyntax *s = &HLDB[j];
+        unsigned int i = 0;
+        while(s->filematch[i]){
+            int is_ext = (s->filematch[i][0] == '.');
+            if((is_ext && ext && !strcmp(ext, s->filematch[i])) || (!is_ext && strstr(B->filename, s->filematch[i]))){
+                editorSyntaxCompile(s);
+                B->syntax = s;
+                editorRowEvict(0, 0);
+                B->hl_valid = B->hl_lexed = B->hl_dirty = 0;
+                traceSpan("highlight", "editorSelectSyntaxHighlight", start, NULL, 0);
+                return;
+            }
+        i++;
+        }
+    }
+}
+
+/* Row Operations */
+
+/*
+ * The row being edited keeps a gap at the cursor inside its chars buffer,
+ * so runs of inserts and deletes there don't move the rest of the line.
+ * The gap is closed again before anything that needs contiguous bytes or
+ * changes the row store (which may move the erow itself).
+ */
+
+void editorGapClose(){
+    erow *row = B->gap_row;
+    if(row == NULL) return;
+    memmove(&row->chars[B->gap_start], &row->chars[B->gap_start + B->gap_len], row->size - B->gap_start + 1);
+    B->gap_row = NULL;
+}
+
+void editorRowOwn(erow *row){
+    if(!row->mapped) return;
+    char *chars = malloc(row->size + 1);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    row->chars = chars;
+    row->mapped = 0;
+}
+
+void editorGapMove(erow *row, int at, int need){
+    if(B->gap_row != row){
+        editorGapClose();
+        editorRowOwn(row);
+        B->gap_row = row;
+        B->gap_start = row->size;
+        B->gap_len = 0;
+    }
+
+    if(B->gap_len < need){
+        int grow = need + (row->size + B->gap_len) / 2 + TUNA_GAP_MIN;
+        row->chars = realloc(row->chars, row->size + B->gap_len + grow + 1);
+        memmove(&row->chars[B->gap_start + B->gap_len + grow], &row->chars[B->gap_start + B->gap_len], row->size - B->gap_start + 1);
+        B->gap_len += grow;
+    }
+
+    if(at < B->gap_start){
+        memmove(&row->chars[at + B->gap_len], &row->chars[at], B->gap_start - at);
+    }else if(at > B->gap_start){
+        memmove(&row->chars[B->gap_start], &row->chars[B->gap_start + B->gap_len], at - B->gap_start);
+    }
+    B->gap_start = at;
+}
+
+static inline char editorRowChar(erow *row, int j){
+    if(row == B->gap_row && j >= B->gap_start) j += B->gap_len;
+    return row->chars[j];
+}
+
+int editorRowCxToRx(erow *row, int cx){
+    int rx = 0;
+    int j;
+    for(j = 0; j < cx; j++){
+        if(editorRowChar(row, j) == '\t')
+            rx += (TUNA_TAB_STOP - 1) - (rx % TUNA_TAB_STOP);
+        rx++;
+    }
+    return rx;
+}
+int editorRowRxToCx(erow *row, int rx){
+    int cur_rx = 0;
+    int cx;
+    for(cx = 0; cx < row->size; cx++){
+        if(editorRowChar(row, cx) == '\t')
+            cur_rx += (TUNA_TAB_STOP - 1) - (cur_rx % TUNA_TAB_STOP);
+        cur_rx++;
+
+        if(cur_rx > rx) return cx;
+    }
+    return cx;
+}
+
+void editorRowDropCache(int filerow){
+    int off;
+    if(filerow < 0 || filerow >= B->numrows) return;
+    rowLeaf *leaf = rowStoreFind(filerow, &off, 0);
+    rowLeafDropCache(leaf, off);
+}
+
+void editorRowEvict(int keep_from, int keep_to){
+    int base = 0;
+    for(rowLeaf *leaf = rowStoreFirst(); leaf; leaf = leaf->next){
+        if(leaf->cached && (base + leaf->h.n <= keep_from || base >= keep_to)){
+            for(int i = 0; i < leaf->h.n; i++){
+                erow *row = &leaf->rows[i];
+                free(row->cache);
+                row->cache = NULL;
+            }
+            B->cached_rows -= leaf->cached;
+            leaf->cached = 0;
+        }else if(leaf->cached){
+            for(int i = 0; i < leaf->h.n; i++){
+                int filerow = base + i;
+                if(filerow < keep_from || filerow >= keep_to) editorRowDropCache(filerow);
+            }
+        }
+        base += leaf->h.n;
+    }
+}
+
+erow *editorRowRender(int filerow){
+    erow *row = editorRowAt(filerow);
+    if(row == NULL) return NULL;
+
+    editorSyntaxSync(filerow);
+    if(row->cache) return row;
+
+    int budget = E.screenrows * 4 > TUNA_RENDER_CACHE ? E.screenrows * 4 : TUNA_RENDER_CACHE;
+    if(B->cached_rows >= budget) editorRowEvict(B->rowoff - E.screenrows, B->rowoff + 2 * E.screenrows);
+
+    int tabs = 0;
+    int j;
+    char *tab = memchr(row->chars, '\t', row->size);
+    if(tab || row == B->gap_row)
+        for(j = 0; j < row->size; j++)
+            if(editorRowChar(row, j) == '\t') tabs++;
+
+    static char *scratch = NULL;
+    static int scratch_len = 0;
+    int rsize = row->size + tabs*(TUNA_TAB_STOP - 1);
+    int copy = tabs || row == B->gap_row;
+    char *render = row->chars;
+
+    if(copy){
+        if(rsize + 1 > scratch_len){
+            scratch_len = rsize + 1;
+            scratch = realloc(scratch, scratch_len);
+        }
+        render = scratch;
+        int idx = 0;
+        for(j = 0; j<row->size; j++){
+            char c = editorRowChar(row, j);
+            if(c == '\t'){
+                render[idx++] = ' ';
+                while(idx % TUNA_TAB_STOP != 0) render[idx++] = ' ';
+            }else{
+                render[idx++] = c;
+            }
+        }
+        render[idx] = '\0';
+        rsize = idx;
+    }
+
+    int nspan;
+    hlSpan *span = editorUpdateSyntax(filerow, render, rsize, &nspan);
+
+    erowCache *cache = malloc(sizeof(erowCache) + sizeof(hlSpan) * nspan + (copy ? rsize + 1 : 0));
+    E.stats.allocs++;
+    cache->rsize = rsize;
+    cache->nspan = nspan;
+    if(nspan) memcpy(cache->span, span, sizeof(hlSpan) * nspan);
+    if(copy){
+        cache->render = (char *)&cache->span[nspan];
+        memcpy(cache->render, render, rsize + 1);
+    }else{
+        cache->render = row->chars;
+    }
+    row->cache = cache;
+    rowStoreCount(filerow, 1);
+    return row;
+}
+
+void editorUpdateRow(int filerow){
+    editorSyntaxInvalidate(filerow);
+}
+
+void editorInsertRow(int at, char *s, size_t len){
+    if(at < 0 || at > B->numrows) return;
+
+    editorGapClose();
+    int state = at > 0 ? editorRowAt(at - 1)->hl_open_comment : 0;
+    erow *row = rowStoreInsert(at);
+    B->numrows++;
+
+    row->size = len;
+    row->chars = malloc(len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+
+    row->cache = NULL;
+    row->mapped = 0;
+    row->hl_open_comment = state;
+    row->hl_dirty = 0;
+    if(at < B->hl_lexed){
+        B->hl_lexed++;
+        row->hl_dirty = 1;
+        B->hl_dirty++;
+    }
+    if(at < B->hl_valid) B->hl_valid = at;
+
+    B->dirty++;
+}
+
+void editorFreeRow(erow *row){
+    free(row->cache);
+    if(!row->mapped) free(row->chars);
 }
 
 void editorDelRow(int at){
-    if(at < 0 || at >= E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for(int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-    E.numrows--;
-    E.dirty++;
+    if(at < 0 || at >= B->numrows) return;
+    editorGapClose();
+    editorRowDropCache(at);
+    erow *row = editorRowAt(at);
+    if(at < B->hl_lexed){
+        if(row->hl_dirty) B->hl_dirty--;
+        B->hl_lexed--;
+    }
+    editorFreeRow(row);
+    rowStoreDelete(at);
+    B->numrows--;
+    editorSyntaxInvalidate(at);
+    B->dirty++;
 }
 
-void editorRowInsertChat(erow *row, int at, int c){
+void editorRowInsertChat(int filerow, int at, int c){
+    erow *row = editorRowAt(filerow);
     if(at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+    editorGapMove(row, at, 1);
+    row->chars[B->gap_start++] = c;
+    B->gap_len--;
     row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+    editorUpdateRow(filerow);
+    B->dirty++;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len){
+void editorRowAppendString(int filerow, char *s, size_t len){
+    erow *row = editorRowAt(filerow);
+    if(row == B->gap_row) editorGapClose();
+    editorRowOwn(row);
     row->chars = realloc(row->chars, row->size + len + 1);
     memcpy(&row->chars[row->size], s, len);
     row->size += len;
     row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+    editorUpdateRow(filerow);
+    B->dirty++;
 }
 
-void editorRowDelChar(erow *row, int at){
+void editorRowDelChar(int filerow, int at){
+    erow *row = editorRowAt(filerow);
     if(at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+    editorGapMove(row, at + 1, 0);
+    B->gap_start--;
+    B->gap_len++;
     row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+    editorUpdateRow(filerow);
+    B->dirty++;
 }
 
 /* Editor Operations */
 
 void editorInsertChar(int c){
-    if(E.cy == E.numrows){
-        editorInsertRow(E.numrows, "", 0);
+    int flags = 0;
+    if(B->cy == B->numrows) editorLoadWait(INT_MAX);
+    if(B->cy == B->numrows){
+        editorInsertRow(B->numrows, "", 0);
+        flags = UNDO_EOF;
+    }
+    char ch = c;
+    editorUndoInsert(B->cy, B->cx, &ch, 1, flags);
+    journalInsert(B->cy, B->cx, &ch, 1);
+    editorRowInsertChat(B->cy, B->cx, c);
+    B->cx++;
+}
+
+void editorInsertNewLine(){
+    if(B->cy == B->numrows) editorLoadWait(INT_MAX);
+    if(B->cy == B->numrows){
+        /* Only the row itself is new, so it is recorded as an empty insert */
+        editorUndoInsert(B->cy, 0, "", 0, UNDO_SEAL | UNDO_EOF);
+        journalInsert(B->cy, 0, "", 0);
+        editorInsertRow(B->cy, "", 0);
+        B->cy++;
+        B->cx = 0;
+        return;
+    }
+    editorUndoInsert(B->cy, B->cx, "\n", 1, UNDO_SEAL);
+    journalInsert(B->cy, B->cx, "\n", 1);
+    if(B->cx == 0){
+        editorInsertRow(B->cy, "", 0);
+    }else{
+        editorGapClose();
+        erow *row = editorRowAt(B->cy);
+        editorInsertRow(B->cy + 1, &row->chars[B->cx], row->size - B->cx);
+        row = editorRowAt(B->cy);
+        editorRowOwn(row);
+        row->size = B->cx;
+        row->chars[row->size] = '\0';
+        editorUpdateRow(B->cy);
+    }
+    B->cy++;
+    B->cx = 0;
+}
+
+/*
+ * Inserts len bytes at the cursor, splitting rows at '\n', and leaves the
+ * cursor after them. The tail of the cursor row is moved once, so this is
+ * O(len) however many lines s spans. Not recorded for undo.
+ */
+void editorInsertText(char *s, int len){
+    if(B->cy == B->numrows){
+        editorInsertRow(B->numrows, "", 0);
+    }
+    editorGapClose();
+    erow *row = editorRowAt(B->cy);
+    editorRowOwn(row);
+    int tail_len = row->size - B->cx;
+    char *tail = malloc(tail_len + 1);
+    memcpy(tail, &row->chars[B->cx], tail_len);
+    row->size = B->cx;
+    row->chars[row->size] = '\0';
+
+    int start = 0, first = 1;
+    for(int i = 0; i <= len; i++){
+        if(i < len && s[i] != '\n') continue;
+        if(first){
+            editorRowAppendString(B->cy, &s[start], i - start);
+            first = 0;
+        }else{
+            editorInsertRow(B->cy + 1, &s[start], i - start);
+            B->cy++;
+        }
+        start = i + 1;
+    }
+    B->cx = editorRowAt(B->cy)->size;
+    editorRowAppendString(B->cy, tail, tail_len);
+    free(tail);
+}
+
+void editorDelChar(){
+    if(B->cy == B->numrows) return;
+    if(B->cx == 0 && B->cy == 0) return;
+
+    erow *row = editorRowAt(B->cy);
+    if(B->cx > 0){
+        editorUndoDelete(B->cy, B->cx - 1, editorRowChar(row, B->cx - 1));
+        journalDelete(B->cy, B->cx - 1, 1);
+        editorRowDelChar(B->cy, B->cx - 1);
+        B->cx--;
+    }else{
+        editorGapClose();
+        B->cx = editorRowAt(B->cy - 1)->size;
+        editorUndoDelete(B->cy - 1, B->cx, '\n');
+        journalDelete(B->cy - 1, B->cx, 1);
+        editorRowAppendString(B->cy - 1, row->chars, row->size);
+        editorDelRow(B->cy);
+        B->cy--;
+    }
+}
+
+/*
+ * Deletes len bytes starting at (at, col), '\n' counting as one. Whole
+ * rows in the middle are dropped from the store without touching their
+ * text, and running off the end of the file removes the rows outright.
+ * Not recorded for undo.
+ */
+void editorDeleteText(int at, int col, int len){
+    editorGapClose();
+    erow *row = editorRowAt(at);
+    if(len <= row->size - col){
+        editorRowOwn(row);
+        memmove(&row->chars[col], &row->chars[col + len], row->size - col - len + 1);
+        row->size -= len;
+        editorUpdateRow(at);
+        B->dirty++;
+        return;
+    }
+
+    int left = len - (row->size - col) - 1;
+    int end = at + 1;
+    while(end < B->numrows && left > editorRowAt(end)->size){
+        left -= editorRowAt(end)->size + 1;
+        end++;
+    }
+    if(end >= B->numrows){
+        for(int i = B->numrows - 1; i > at; i--) editorDelRow(i);
+        if(col == 0){
+            editorDelRow(at);
+            return;
+        }
+        editorRowOwn(row);
+        row->size = col;
+        row->chars[col] = '\0';
+        editorUpdateRow(at);
+        B->dirty++;
+        return;
+    }
+
+    erow *last = editorRowAt(end);
+    editorRowOwn(row);
+    row->size = col;
+    row->chars[col] = '\0';
+    editorRowAppendString(at, &last->chars[left], last->size - left);
+    for(int i = end; i > at; i--) editorDelRow(i);
+}
+
+/*
+ * Bracketed paste: line endings are folded to '\n' in place, then the
+ * whole paste goes in as a single undo record. Returns 1 if the history
+ * kept s, in which case the caller must not reuse it.
+ */
+int editorPaste(char *s, int len){
+    if(B->cy == B->numrows) editorLoadWait(INT_MAX);
+    int j = 0;
+    for(int i = 0; i < len; i++){
+        if(s[i] == '\r'){
+            s[j++] = '\n';
+            if(i + 1 < len && s[i + 1] == '\n') i++;
+        }else{
+            s[j++] = s[i];
+        }
+    }
+    len = j;
+    if(len == 0) return 0;
+
+    int adopt = len >= TUNA_UNDO_ADOPT;
+    int eof = B->cy == B->numrows;
+    journalInsert(B->cy, B->cx, s, len);
+    editorUndoInsert(B->cy, B->cx, s, len, UNDO_SEAL | (adopt ? UNDO_ADOPT : 0) | (eof ? UNDO_EOF : 0));
+    editorInsertText(s, len);
+    return adopt;
+}
+
+/* Undo */
+
+static void undoDrop(undoRecord *r){
+    if(r->block == NULL){
+        free(r->text);
+        B->undo.bytes -= r->len;
+    }else if(--r->block->refs == 0 && r->block != B->undo.cur){
+        B->undo.bytes -= r->block->size;
+        free(r->block);
+    }
+}
+
+void editorUndoClear(){
+    for(int i = 0; i < B->undo.n; i++) undoDrop(&B->undo.rec[i]);
+    B->undo.n = B->undo.pos = B->undo.saved = 0;
+    if(B->undo.cur){
+        B->undo.bytes -= B->undo.cur->size;
+        free(B->undo.cur);
+        B->undo.cur = NULL;
+    }
+}
+
+static char *undoAlloc(int len, undoBlock **block){
+    undoBlock *b = B->undo.cur;
+    if(b == NULL || b->size - b->used < len){
+        if(b && b->refs == 0){
+            B->undo.bytes -= b->size;
+            free(b);
+        }
+        int size = len > TUNA_UNDO_BLOCK ? len : TUNA_UNDO_BLOCK;
+        b = malloc(sizeof(undoBlock) + size);
+        if(b == NULL) die("malloc");
+        b->refs = 0;
+        b->used = 0;
+        b->size = size;
+        B->undo.cur = b;
+        B->undo.bytes += size;
+    }
+    char *p = &b->data[b->used];
+    b->used += len;
+    b->refs++;
+    *block = b;
+    return p;
+}
+
+/*
+ * The newest record can only grow while its text is still the last thing
+ * in the arena and nothing has been undone since it was written.
+ */
+static undoRecord *undoTail(int type){
+    if(B->undo.pos != B->undo.n || B->undo.n == 0) return NULL;
+    if(B->undo.saved == B->undo.n || (E.save_buf == B && E.save_undo == B->undo.n)) return NULL;
+    undoRecord *r = &B->undo.rec[B->undo.n - 1];
+    undoBlock *b = B->undo.cur;
+    if(r->sealed || r->type != type || r->block != b) return NULL;
+    if(r->text + r->len != &b->data[b->used] || b->used == b->size) return NULL;
+    return r;
+}
+
+/* Forgets anything that could have been redone, then the oldest records
+ * while over TUNA_UNDO_CAP. */
+static void undoTrim(){
+    if(B->undo.saved > B->undo.pos) B->undo.saved = -1;
+    if(E.save_buf == B && E.save_undo > B->undo.pos) E.save_undo = -1;
+    while(B->undo.n > B->undo.pos){
+        undoRecord *r = &B->undo.rec[--B->undo.n];
+        undoBlock *b = B->undo.cur;
+        if(r->block == b && r->text + r->len == &b->data[b->used]) b->used -= r->len;
+        undoDrop(r);
+    }
+    int drop = 0;
+    while(drop < B->undo.n && B->undo.bytes > TUNA_UNDO_CAP) undoDrop(&B->undo.rec[drop++]);
+    if(drop){
+        memmove(B->undo.rec, &B->undo.rec[drop], (B->undo.n - drop) * sizeof(undoRecord));
+        B->undo.n -= drop;
+        B->undo.pos = B->undo.n;
+        B->undo.saved = B->undo.saved >= drop ? B->undo.saved - drop : -1;
+        if(E.save_buf == B) E.save_undo = E.save_undo >= drop ? E.save_undo - drop : -1;
+    }
+}
+
+static undoRecord *undoPush(int type, int row, int col){
+    undoTrim();
+    if(B->undo.n == B->undo.cap){
+        B->undo.cap = B->undo.cap ? B->undo.cap * 2 : 256;
+        B->undo.rec = realloc(B->undo.rec, B->undo.cap * sizeof(undoRecord));
+        if(B->undo.rec == NULL) die("realloc");
+    }
+    undoRecord *r = &B->undo.rec[B->undo.n++];
+    B->undo.pos = B->undo.n;
+    r->type = type;
+    r->reverse = 0;
+    r->sealed = 0;
+    r->eof = 0;
+    r->row = row;
+    r->col = col;
+    r->len = 0;
+    r->text = NULL;
+    r->block = NULL;
+    return r;
+}
+
+/* Typed characters extend the open insert record when they land right
+ * after it; UNDO_ADOPT takes ownership of s instead of copying it. */
+void editorUndoInsert(int row, int col, char *s, int len, int flags){
+    undoRecord *r = undoTail(UNDO_INSERT);
+    if(!(flags & (UNDO_SEAL | UNDO_EOF)) && len == 1 && r && r->row == row && r->col + r->len == col){
+        B->undo.cur->data[B->undo.cur->used++] = *s;
+        r->len++;
+        return;
+    }
+    r = undoPush(UNDO_INSERT, row, col);
+    r->len = len;
+    if(flags & UNDO_ADOPT){
+        r->text = s;
+        B->undo.bytes += len;
+    }else{
+        r->text = undoAlloc(len, &r->block);
+        memcpy(r->text, s, len);
+    }
+    r->sealed = (flags & UNDO_SEAL) != 0;
+    r->eof = (flags & UNDO_EOF) != 0;
+    undoTrim();
+}
+
+/* Backspace runs grow leftwards, so their text is kept back to front. */
+void editorUndoDelete(int row, int col, char c){
+    undoRecord *r = undoTail(UNDO_DELETE);
+    if(r && r->reverse){
+        int ends = (c == '\n') ? (r->row == row + 1 && r->col == 0) : (r->row == row && r->col == col + 1);
+        if(ends){
+            B->undo.cur->data[B->undo.cur->used++] = c;
+            r->len++;
+            r->row = row;
+            r->col = col;
+            return;
+        }
+    }
+    r = undoPush(UNDO_DELETE, row, col);
+    r->reverse = 1;
+    r->len = 1;
+    r->text = undoAlloc(1, &r->block);
+    r->text[0] = c;
+    undoTrim();
+}
+
+/* Replays r forwards, or backwards when undoing; either way it is one
+ * bulk insert or delete however large the record is. */
+static void undoApply(undoRecord *r, int undo){
+    if((r->type == UNDO_INSERT) == !undo){
+        B->cy = r->row;
+        B->cx = r->col;
+        if(r->reverse){
+            char *buf = malloc(r->len);
+            if(buf == NULL) die("malloc");
+            for(int i = 0; i < r->len; i++) buf[i] = r->text[r->len - 1 - i];
+            journalInsert(r->row, r->col, buf, r->len);
+            editorInsertText(buf, r->len);
+            free(buf);
+        }else{
+            journalInsert(r->row, r->col, r->text, r->len);
+            editorInsertText(r->text, r->len);
+        }
+    }else{
+        journalDelete(r->row, r->col, r->len + r->eof);
+        editorDeleteText(r->row, r->col, r->len + r->eof);
+        B->cy = r->row;
+        B->cx = r->col;
+    }
+    if(B->cy > B->numrows) B->cy = B->numrows;
+    r->sealed = 1;
+}
+
+void editorUndo(){
+    if(B->undo.pos == 0){
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    undoApply(&B->undo.rec[--B->undo.pos], 1);
+    if(B->undo.pos == B->undo.saved) B->dirty = 0;
+}
+
+void editorRedo(){
+    if(B->undo.pos == B->undo.n){
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    undoApply(&B->undo.rec[B->undo.pos++], 0);
+    if(B->undo.pos == B->undo.saved) B->dirty = 0;
+}
+
+/* Delete */
+
+void editorClear(){
+	editorGapClose();
+	editorUndoClear();
+	rowStoreClear();
+	B->hl_valid = B->hl_lexed = B->hl_dirty = 0;
+	if(B->map){
+		if(B->map_heap) free(B->map);
+		else munmap(B->map, B->map_len);
+		B->map = NULL;
+		B->map_len = 0;
+		B->map_heap = 0;
+	}
+}
+
+/* Large Files */
+
+/*
+ * Files above TUNA_LOAD_ASYNC are loaded on a thread. It builds finished
+ * leaves off to the side, TUNA_LOAD_CHUNK bytes at a time, and hands them
+ * over under ld->lock; the first chunk is only TUNA_LOAD_FIRST bytes so
+ * the first screen can be drawn straight away. The main loop hangs the
+ * leaves off the end of the tree in editorLoadPoll, so the rows already
+ * loaded can be shown, scrolled and edited while the rest streams in.
+ * Anything that needs rows further on waits in editorLoadWait for just
+ * those rows.
+ *
+ * Files above TUNA_MMAP_THRESHOLD are mapped instead of read, and loading
+ * one only scans it for newlines and builds mapped leaves; rows point
+ * straight into the mapping and a line is copied into owned memory when it
+ * is first edited. The mapping is private and read-only, and saving always
+ * goes to a new file, so the original stays intact underneath the rows
+ * unless another program rewrites it in place.
+ *
+ * Smaller files are read whole into one heap block that stands in for the
+ * mapping (B->map_heap), so they get the same 4-byte mapped rows instead
+ * of an erow and a malloc per line.
+ */
+
+struct mapIndex{
+    rowLeaf *first;
+    rowMapLeaf *leaf;
+    size_t start;
+};
+
+static void mapIndexLine(struct mapIndex *ix, size_t nl){
+    rowMapLeaf *ml = ix->leaf;
+    if(ml == NULL || ml->h.n == ROWS_PER_LEAF || nl - ml->base > UINT32_MAX){
+        rowMapLeaf *next = calloc(1, sizeof(rowMapLeaf));
+        next->h.leaf = ROW_LEAF_MAPPED;
+        next->base = ix->start;
+        if(ml){
+            ml->next = (rowLeaf *)next;
+            next->prev = (rowLeaf *)ml;
+        }else{
+            ix->first = (rowLeaf *)next;
+        }
+        ix->leaf = ml = next;
+    }
+    ml->nl[ml->h.n++] = nl - ml->base;
+    ml->h.count = ml->h.n;
+    ix->start = nl + 1;
+}
+
+static void editorMapIndex(const char *map, size_t i, size_t len, struct mapIndex *ix){
+#if defined(__AVX2__)
+    const __m256i nl = _mm256_set1_epi8('\n');
+    for(; i + 32 <= len; i += 32){
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(map + i)), nl));
+        while(mask){
+            mapIndexLine(ix, i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i nl = _mm_set1_epi8('\n');
+    for(; i + 16 <= len; i += 16){
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(map + i)), nl));
+        while(mask){
+            mapIndexLine(ix, i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for(; i < len; i++)
+        if(map[i] == '\n') mapIndexLine(ix, i);
+}
+
+/*
+ * Passes every leaf but the one still being filled to the main thread, or
+ * all of them once the file is done.
+ */
+static void loadPublish(struct editorLoad *ld, struct mapIndex *ix, size_t loaded, int all){
+    rowLeaf *first = ix->first, *last = (rowLeaf *)ix->leaf;
+    if(!all){
+        if(first == last) first = NULL;
+        else{
+            last = last->prev;
+            last->next = NULL;
+            ix->leaf->prev = NULL;
+            ix->first = (rowLeaf *)ix->leaf;
+        }
+    }
+
+    pthread_mutex_lock(&ld->lock);
+    if(first){
+        if(ld->last) ld->last->next = first;
+        else ld->first = first;
+        ld->last = last;
+    }
+    ld->loaded = loaded;
+    ld->done = all;
+    pthread_cond_broadcast(&ld->cond);
+    pthread_mutex_unlock(&ld->lock);
+
+    long long now = editorClockMs();
+    if(all || now - ld->woken >= TUNA_FRAME_MS){
+        ld->woken = now;
+        editorWake();
+    }
+}
+
+static void loadFreeChain(rowLeaf *leaf){
+    while(leaf){
+        rowLeaf *next = leaf->next;
+        free(leaf);
+        leaf = next;
+    }
+}
+
+struct loadArgs{
+    struct editorLoad *ld;
+    char *map;
+};
+
+/*
+ * Touching a page of a mapped file past its end raises SIGBUS, which is
+ * what happens when something truncates the file while it is open. The
+ * handler maps zero pages over the mapping from that page on, so the
+ * access that faulted and every later one read NUL bytes instead, and
+ * leaves the address for the loader and editorMapFaultPoll. A SIGBUS
+ * anywhere else gets the default action. Rows already shown from those
+ * pages change under the user, but the buffer and its edits survive.
+ */
+static char *volatile map_fault;
+static long map_page;
+
+static void handleSigBus(int sig, siginfo_t *si, void *uc){
+    (void)uc;
+    char *addr = si->si_addr;
+    for(int i = 0; i < E.nbuffers; i++){
+        struct editorBuffer *b = E.buffers[i];
+        if(b->map == NULL || b->map_heap || addr < b->map || addr >= b->map + b->map_len) continue;
+        char *from = b->map + ((addr - b->map) & ~(map_page - 1));
+        if(mmap(from, b->map + b->map_len - from, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED){
+            map_fault = addr;
+            editorWake();
+            return;
+        }
+    }
+    signal(sig, SIG_DFL);
+}
+
+static int mapFaulted(char *map, size_t size){
+    char *fault = map_fault;
+    return fault >= map && fault < map + size;
+}
+
+void editorMapFaultPoll(){
+    static char *reported;
+    char *fault = map_fault;
+    if(fault == reported) return;
+    reported = fault;
+    for(int i = 0; i < E.nbuffers; i++){
+        struct editorBuffer *b = E.buffers[i];
+        if(b->map && !b->map_heap && mapFaulted(b->map, b->map_len)){
+            editorSetStatusMessage("%s shrank on disk; from byte %lld on it reads as NULs",
+                                   b->filename, (long long)(fault - b->map) & ~(map_page - 1));
+        }
+    }
+}
+
+static void *loadWorker(void *arg){
+    struct loadArgs *a = arg;
+    struct editorLoad *ld = a->ld;
+    char *map = a->map;
+    free(a);
+    struct mapIndex ix = {NULL, NULL, 0};
+    size_t at = 0;
+    long long start = editorClockUs();
+    traceThread("load");
+
+    while(at < ld->size && !__atomic_load_n(&ld->cancel, __ATOMIC_RELAXED)){
+        size_t chunk = at ? TUNA_LOAD_CHUNK : TUNA_LOAD_FIRST;
+        size_t to = ld->size - at > chunk ? at + chunk : ld->size;
+        if(ld->fd != -1){
+            ssize_t got = read(ld->fd, map + at, to - at);
+            if(got == -1 && errno == EINTR) continue;
+            if(got <= 0){
+                if(got == -1) ld->err = errno;
+                break;
+            }
+            to = at + got;
+        }
+        editorMapIndex(map, at, to, &ix);
+        at = to;
+        if(ld->fd == -1 && mapFaulted(map, ld->size)){
+            size_t cut = (map_fault - map) & ~(map_page - 1);
+            if(cut < at) at = cut;
+            ld->err = EIO;
+            break;
+        }
+        if(at < ld->size) loadPublish(ld, &ix, at, 0);
+    }
+    if(ix.start < at) mapIndexLine(&ix, at);
+
+    if(__atomic_load_n(&ld->cancel, __ATOMIC_RELAXED)){
+        loadFreeChain(ix.first);
+        ix.first = NULL;
+        ix.leaf = NULL;
+    }
+    traceSpan("load", "loadWorker", start, "bytes", at);
+    loadPublish(ld, &ix, at, 1);
+    return NULL;
+}
+
+int editorLoadStart(int fd, size_t size){
+    char *map;
+    int heap = size < TUNA_MMAP_THRESHOLD;
+    if(heap){
+        map = malloc(size);
+        if(map == NULL) return -1;
+    }else{
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map == MAP_FAILED) return -1;
+        madvise(map, size, MADV_SEQUENTIAL);
+        if(map_page == 0){
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_sigaction = handleSigBus;
+            sa.sa_flags = SA_SIGINFO | SA_RESTART;
+            map_page = sysconf(_SC_PAGESIZE);
+            sigaction(SIGBUS, &sa, NULL);
+        }
+    }
+
+    struct editorLoad *ld = calloc(1, sizeof(struct editorLoad));
+    ld->fd = heap ? dup(fd) : -1;
+    ld->size = size;
+    ld->start = editorClockMs();
+    pthread_mutex_init(&ld->lock, NULL);
+    pthread_cond_init(&ld->cond, NULL);
+    struct loadArgs *a = malloc(sizeof(struct loadArgs));
+    a->ld = ld;
+    a->map = map;
+    if((heap && ld->fd == -1) || pthread_create(&ld->thread, NULL, loadWorker, a) != 0){
+        if(ld->fd != -1) close(ld->fd);
+        if(heap) free(map);
+        else munmap(map, size);
+        free(a);
+        free(ld);
+        return -1;
+    }
+    B->map = map;
+    B->map_len = size;
+    B->map_heap = heap;
+    B->load = ld;
+    return 0;
+}
+
+/* Moves whatever the loader has finished into b, and retires the loader
+ * once it is done. Returns 1 if anything changed. */
+static int loadTake(struct editorBuffer *b){
+    struct editorLoad *ld = b->load;
+    pthread_mutex_lock(&ld->lock);
+    rowLeaf *first = ld->first;
+    int done = ld->done;
+    ld->first = ld->last = NULL;
+    pthread_mutex_unlock(&ld->lock);
+
+    struct editorBuffer *active = B;
+    B = b;
+    if(first){
+        editorGapClose();
+        rowStoreAppend(first);
+    }
+    if(b == active && (first || done)) editorSearchExtend(&E.search, first, done);
+    if(done){
+        pthread_join(ld->thread, NULL);
+        if(ld->fd != -1) close(ld->fd);
+        if(B->map && !B->map_heap) madvise(B->map, B->map_len, MADV_NORMAL);
+        if(ld->err) editorSetStatusMessage("Error reading %s: %s", B->filename, strerror(ld->err));
+        else if(b == active) editorSetStatusMessage("Loaded %d lines in %lld ms", B->numrows, editorClockMs() - ld->start);
+        pthread_mutex_destroy(&ld->lock);
+        pthread_cond_destroy(&ld->cond);
+        free(ld);
+        B->load = NULL;
+    }
+    B = active;
+    return first != NULL || done;
+}
+
+int editorLoadPoll(){
+    int news = 0;
+    for(int i = 0; i < E.nbuffers; i++){
+        if(E.buffers[i]->load) news |= loadTake(E.buffers[i]);
+    }
+    return news;
+}
+
+/* Blocks until row exists or the whole file is in; INT_MAX waits for all. */
+void editorLoadWait(int row){
+    while(B->load && row >= B->numrows){
+        struct editorLoad *ld = B->load;
+        pthread_mutex_lock(&ld->lock);
+        while(ld->first == NULL && !ld->done) pthread_cond_wait(&ld->cond, &ld->lock);
+        pthread_mutex_unlock(&ld->lock);
+        loadTake(B);
+    }
+}
+
+void editorLoadCancel(struct editorBuffer *b){
+    if(b->load == NULL) return;
+    __atomic_store_n(&b->load->cancel, 1, __ATOMIC_RELAXED);
+    pthread_join(b->load->thread, NULL);
+    loadFreeChain(b->load->first);
+    if(b->load->fd != -1) close(b->load->fd);
+    pthread_mutex_destroy(&b->load->lock);
+    pthread_cond_destroy(&b->load->cond);
+    free(b->load);
+    b->load = NULL;
+}
+
+/* File i/o */
+
+/*
+ * Saving streams the rows straight out of the buffer into a temporary file
+ * next to the original with writev, then renames it into place, so a save
+ * that fails halfway leaves the old file untouched. Lines that still sit
+ * back to back in the mapping, newlines included, collapse into a single
+ * iovec. Unless built with TUNA_FSYNC=0 the file and its directory entry
+ * are flushed to disk before the save is reported.
+ */
+
+struct saveWriter{
+    int fd;
+    struct iovec iov[TUNA_SAVE_IOV];
+    int n;
+    long long total;
+};
+
+static int saveFlush(struct saveWriter *w){
+    struct iovec *iov = w->iov;
+    int n = w->n;
+    while(n > 0){
+        ssize_t done = writev(w->fd, iov, n);
+        if(done == -1){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        w->total += done;
+        while(n > 0 && (size_t)done >= iov->iov_len){
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if(n > 0){
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
     }
-    editorRowInsertChat(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    w->n = 0;
+    return 0;
 }
 
-void editorInsertNewLine(){
-    if(E.cx == 0){
-        editorInsertRow(E.cy, "", 0);
-    }else{
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+static int saveAppend(struct saveWriter *w, const char *s, size_t len){
+    if(w->n > 0){
+        struct iovec *last = &w->iov[w->n - 1];
+        if((char *)last->iov_base + last->iov_len == s){
+            last->iov_len += len;
+            return 0;
+        }
     }
-    E.cy++;
-    E.cx = 0;
+    if(w->n == TUNA_SAVE_IOV && saveFlush(w) == -1) return -1;
+    w->iov[w->n].iov_base = (void *)s;
+    w->iov[w->n].iov_len = len;
+    w->n++;
+    return 0;
 }
 
-void editorDelChar(){
-    if(E.cy == E.numrows) return;
-    if(E.cx == 0 && E.cy == 0) return;
-
-    erow *row = &E.row[E.cy];
-    if(E.cx > 0){
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
-    }else{
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+static int saveRows(struct saveWriter *w){
+    int len;
+    editorGapClose();
+    for(rowLeaf *leaf = rowStoreFirst(); leaf; leaf = leaf->next){
+        for(int j = 0; j < leaf->h.n; j++){
+            char *line = rowStoreLine(leaf, j, &len);
+            if(B->map && line >= B->map && line + len < B->map + B->map_len && line[len] == '\n'){
+                if(saveAppend(w, line, len + 1) == -1) return -1;
+            }else{
+                if(saveAppend(w, line, len) == -1 || saveAppend(w, "\n", 1) == -1) return -1;
+            }
+        }
     }
+    return saveFlush(w);
 }
 
-/* Delete */
-
-void editorClear(){
-	while(E.numrows > 0){
-		editorDelRow(E.numrows - 1);
-	}
-}
-
-/* File i/o */
-
-char *editorRowsToString(int *buflen){
-    int totlen = 0;
-    int j;
-    for(j = 0; j <E.numrows; j++){
-        totlen += E.row[j].size + 1;
+int editorSaveFile(const char *filename, long long *written){
+    char *target = realpath(filename, NULL);
+    if(target == NULL) target = strdup(filename);
+    size_t pathlen = strlen(target) + 8;
+    char *tmp = malloc(pathlen);
+    snprintf(tmp, pathlen, "%s.XXXXXX", target);
+
+    struct saveWriter *w = malloc(sizeof(struct saveWriter));
+    w->fd = mkstemp(tmp);
+    w->n = 0;
+    w->total = 0;
+    int failed = w->fd == -1;
+    if(!failed){
+        struct stat st;
+        if(stat(target, &st) == 0){
+            fchmod(w->fd, st.st_mode & 07777);
+        }else{
+            mode_t mask = umask(0);
+            umask(mask);
+            fchmod(w->fd, 0666 & ~mask);
+        }
+        failed = saveRows(w) == -1;
+#if TUNA_FSYNC
+        if(!failed && fsync(w->fd) == -1) failed = 1;
+#endif
+        if(close(w->fd) == -1) failed = 1;
+        if(!failed && rename(tmp, target) == -1) failed = 1;
+        if(failed){
+            int err = errno;
+            unlink(tmp);
+            errno = err;
+        }
     }
-    *buflen = totlen;
 
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for(j = 0; j < E.numrows; j++){
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+#if TUNA_FSYNC
+    if(!failed){
+        char *dir = strdup(target);
+        int dfd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+        if(dfd != -1){
+            fsync(dfd);
+            close(dfd);
+        }
+        free(dir);
     }
-    return buf;
+#endif
+
+    *written = w->total;
+    int err = errno;
+    free(w);
+    free(tmp);
+    free(target);
+    errno = err;
+    return failed ? -1 : 0;
 }
 
 char *expandTilde(const char *path){
@@ -725,11 +3239,7 @@ char *expandTilde(const char *path){
 }
 
 void editorOpen(const char *filename){
-	if(E.dirty){
-		editorSavePrompt();
-		if(E.dirty) return;
-	}
-
+	long long start = editorClockUs();
 	char *full_path;
 	struct stat file_stat;
 
@@ -739,8 +3249,8 @@ void editorOpen(const char *filename){
 		return;
 	}
 	
-	if(E.filename && filename[0] == '~'){
-		char *base_dir = strdup(E.filename);
+	if(B->filename && filename[0] == '~'){
+		char *base_dir = strdup(B->filename);
 		base_dir = dirname(base_dir); // Current file dir		
 
 		size_t len = strlen(base_dir) + strlen(expanded_path) + 2;
@@ -771,6 +3281,14 @@ void editorOpen(const char *filename){
 		fclose(fp);
 	}
 
+	// Already open?
+	struct editorBuffer *open = bufferFind(full_path);
+	if(open){
+		free(full_path);
+		bufferSwitch(open);
+		return;
+	}
+
 	// Open the BOI
 	FILE *fp = fopen(full_path, "r");
 	if(!fp){
@@ -779,55 +3297,142 @@ void editorOpen(const char *filename){
 		return;
 	}
 
+	// Reuse the scratch buffer tuna starts with, otherwise open a new one
+	if(B->filename || B->dirty || B->numrows) bufferSwitch(bufferNew());
 	editorClear();
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while((linelen = getline(&line, &linecap, fp)) != -1){
-        while(linelen>0 && (line[linelen - 1] == '\n' ||
-							line[linelen - 1] == '\r'))
-            linelen--;
-        editorInsertRow(E.numrows, line, linelen);
-    }
-    free(line);
+	if(fstat(fileno(fp), &file_stat) == -1 || file_stat.st_size < TUNA_LOAD_ASYNC ||
+	   editorLoadStart(fileno(fp), file_stat.st_size) == -1){
+        char *line = NULL;
+        size_t linecap = 0;
+        ssize_t linelen;
+        while((linelen = getline(&line, &linecap, fp)) != -1){
+            while(linelen>0 && (line[linelen - 1] == '\n' ||
+							    line[linelen - 1] == '\r'))
+                linelen--;
+            editorInsertRow(B->numrows, line, linelen);
+        }
+        free(line);
+	}
     fclose(fp);
+	editorLoadWait(E.screenrows);
 
-	free(E.filename);
-	E.filename = full_path;
+	free(B->filename);
+	B->filename = full_path;
 
-    E.dirty = 0;
+    B->dirty = 0;
 	editorSelectSyntaxHighlight();
+	journalRecover();
+	traceSpan("load", "editorOpen", start, "rows", B->numrows);
+}
+
+/*
+ * Ctrl-S forks: the child gets a copy-on-write image of the whole buffer,
+ * writes it out with editorSaveFile and sends a saveResult back through a
+ * pipe, while the parent goes straight back to editing. The pipe sits in
+ * editorWait's poll set, so the result shows up like any other event.
+ * B->dirty is lowered by the count it had when the snapshot was taken, so
+ * edits made during the save still count as unsaved.
+ */
+
+struct saveResult{
+    int ok;
+    int err;
+    long long written;
+    long long start;
+    long long end;
+};
+
+static void editorSaveReport(struct saveResult *res){
+    struct editorBuffer *active = B;
+    B = E.save_buf;
+    if(res->ok){
+        traceRecord(E.trace.save_tid, "save", "editorSave", res->start, res->end, "bytes", res->written);
+        B->dirty -= E.save_dirty;
+        if(B->dirty < 0) B->dirty = 0;
+        B->undo.saved = E.save_undo;
+        journalSaved();
+        double ms = (res->end - res->start) / 1000.0;
+        editorSetStatusMessage("%lld bytes written to disk (%.1f MB/s)", res->written, res->written / 1000.0 / (ms > 0 ? ms : 1));
+    }else{
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(res->err));
+    }
+    B = active;
+    E.save_dirty = 0;
+    E.save_buf = NULL;
 }
 
 void editorSave(){
-    if(E.filename == NULL){
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if(E.filename == NULL){
+    if(E.save_pid){
+        editorSetStatusMessage("A save is already in progress");
+        return;
+    }
+    editorLoadWait(INT_MAX);
+    if(B->filename == NULL){
+        B->filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+        if(B->filename == NULL){
             editorSetStatusMessage("Save aborted");
             return;
         }
         editorSelectSyntaxHighlight();
     }
 
-    int len;
-    char *buf = editorRowsToString(&len);
-
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if(fd != -1){
-        if(ftruncate(fd, len) != -1){
-            if(write(fd, buf, len) == len){
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
-        }
-        close(fd);
+    struct saveResult res;
+    res.start = editorClockUs();
+    editorGapClose();
+    journalFlush();
+    B->journal.save_from = B->journal.fd == -1 ? (long long)sizeof(struct journalHeader) : B->journal.size;
+
+    int fds[2] = {-1, -1};
+    pid_t pid = pipe(fds) == 0 ? fork() : -1;
+    if(pid == 0){
+        close(fds[0]);
+        res.ok = editorSaveFile(B->filename, &res.written) == 0;
+        res.err = errno;
+        res.end = editorClockUs();
+        write(fds[1], &res, sizeof(res));
+        _exit(0);
     }
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    if(fds[1] != -1) close(fds[1]);
+
+    if(pid == -1){
+        if(fds[0] != -1) close(fds[0]);
+        res.ok = editorSaveFile(B->filename, &res.written) == 0;
+        res.err = errno;
+        res.end = editorClockUs();
+        E.save_dirty = B->dirty;
+        E.save_undo = B->undo.pos;
+        E.save_buf = B;
+        editorSaveReport(&res);
+        return;
+    }
+    E.save_pid = pid;
+    E.save_fd = fds[0];
+    E.save_dirty = B->dirty;
+    E.save_undo = B->undo.pos;
+    E.save_buf = B;
+    editorSetStatusMessage("Saving %s...", B->filename);
+}
+
+void editorSaveReap(){
+    struct saveResult res;
+    if(E.save_pid == 0) return;
+    if(read(E.save_fd, &res, sizeof(res)) != sizeof(res)){
+        res.ok = 0;
+        res.err = EIO;
+    }
+    close(E.save_fd);
+    waitpid(E.save_pid, NULL, 0);
+    E.save_fd = -1;
+    E.save_pid = 0;
+    editorSaveReport(&res);
+}
+
+void editorSaveWait(){
+    if(E.save_pid == 0) return;
+    struct pollfd pfd = {E.save_fd, POLLIN, 0};
+    while(poll(&pfd, 1, -1) == -1 && errno == EINTR);
+    editorSaveReap();
 }
 
 void editorChangeTitle(){
@@ -839,6 +3444,502 @@ void editorChangeTitle(){
 	}
 }
 
+/* Journal */
+
+/*
+ * Every edit is also appended to a journal next to the file, .NAME.tuna,
+ * so a crash loses at most the last TUNA_JOURNAL_MS of work without ever
+ * rewriting the file itself. Records are a type byte followed by LEB128
+ * row, col and length: 'I' carries the inserted text, 'D' only the length
+ * and 'S' a snapshot of the whole buffer that replaces everything before
+ * it. Typed characters and backspace runs are merged into one record, and
+ * records are collected in memory and written from the event loop once
+ * input goes quiet, never while keys are being handled. The journal only
+ * outlives the editor, not the machine: it is never fsynced.
+ *
+ * When the journal grows to twice the buffer it is compacted into a
+ * single snapshot. Like a save, the snapshot is written by a forked child
+ * from its copy-on-write image. The parent keeps appending to the old
+ * journal, and once the child is done it copies over the records that came
+ * in meanwhile and swaps the new file in. A save makes the journal
+ * obsolete, so it is removed. If edits came in while the save ran, it is
+ * rebuilt from the records journalled since the save forked.
+ */
+
+static const char journal_magic[8] = {'T', 'U', 'N', 'A', 'J', 'N', 'L', '1'};
+
+static char *journalPath(const char *filename){
+    char *dir = strdup(filename);
+    char *base = strdup(filename);
+    char *d = dirname(dir), *b = basename(base);
+    size_t len = strlen(d) + strlen(b) + 8;
+    char *path = malloc(len);
+    snprintf(path, len, "%s/.%s.tuna", d, b);
+    free(dir);
+    free(base);
+    return path;
+}
+
+static void journalReserve(int len){
+    if(B->journal.len + len <= B->journal.cap) return;
+    while(B->journal.len + len > B->journal.cap) B->journal.cap = B->journal.cap ? B->journal.cap * 2 : 4096;
+    B->journal.buf = realloc(B->journal.buf, B->journal.cap);
+    if(B->journal.buf == NULL) die("realloc");
+}
+
+static int journalVarint(char *p, unsigned long long v){
+    int n = 0;
+    while(v >= 0x80){
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+static int journalHead(char *p, char type, int row, int col, long long len){
+    int n = 0;
+    p[n++] = type;
+    n += journalVarint(&p[n], row);
+    n += journalVarint(&p[n], col);
+    n += journalVarint(&p[n], len);
+    return n;
+}
+
+static void journalEmit(char type, int row, int col, const char *s, int len){
+    journalReserve(31 + (type == 'I' ? len : 0));
+    B->journal.len += journalHead(&B->journal.buf[B->journal.len], type, row, col, len);
+    if(type == 'I'){
+        memcpy(&B->journal.buf[B->journal.len], s, len);
+        B->journal.len += len;
+    }
+    if(B->journal.since == 0) B->journal.since = editorClockMs();
+}
+
+static void journalEndRun(){
+    if(B->journal.run == 0) return;
+    journalEmit(B->journal.run, B->journal.run_row, B->journal.run_col, B->journal.run_text, B->journal.run_len);
+    B->journal.run = 0;
+}
+
+static void journalRun(char type, int row, int col, char *s, int len){
+    journalEndRun();
+    B->journal.run = type;
+    B->journal.run_row = row;
+    B->journal.run_col = col;
+    B->journal.run_len = 0;
+    B->journal.run_nl = 0;
+    if(B->journal.since == 0) B->journal.since = editorClockMs();
+    if(type == 'D'){
+        B->journal.run_len = len;
+        return;
+    }
+    if(len > B->journal.run_cap){
+        B->journal.run_cap = len > 64 ? len : 64;
+        B->journal.run_text = realloc(B->journal.run_text, B->journal.run_cap);
+        if(B->journal.run_text == NULL) die("realloc");
+    }
+    memcpy(B->journal.run_text, s, len);
+    B->journal.run_len = len;
+    B->journal.run_nl = *s == '\n';
+}
+
+void journalInsert(int row, int col, char *s, int len){
+    if(B->filename == NULL || B->journal.off) return;
+    if(len == 1 && B->journal.run == 'I' && !B->journal.run_nl && row == B->journal.run_row &&
+       col == B->journal.run_col + B->journal.run_len){
+        if(B->journal.run_len == B->journal.run_cap){
+            B->journal.run_cap *= 2;
+            B->journal.run_text = realloc(B->journal.run_text, B->journal.run_cap);
+            if(B->journal.run_text == NULL) die("realloc");
+        }
+        B->journal.run_text[B->journal.run_len++] = *s;
+        B->journal.run_nl = *s == '\n';
+        return;
+    }
+    if(len == 1){
+        journalRun('I', row, col, s, len);
+        return;
+    }
+    journalEndRun();
+    journalEmit('I', row, col, s, len);
+    if(B->journal.len >= TUNA_JOURNAL_BATCH) journalFlush();
+}
+
+void journalDelete(int row, int col, int len){
+    if(B->filename == NULL || B->journal.off) return;
+    if(B->journal.run == 'D' && row == B->journal.run_row && col + len == B->journal.run_col){
+        B->journal.run_col = col;
+        B->journal.run_len += len;
+        return;
+    }
+    journalRun('D', row, col, NULL, len);
+}
+
+/* Milliseconds until the buffered records are due, -1 if there are none. */
+int journalTimeout(){
+    if(B->journal.since == 0) return -1;
+    long long left = B->journal.since + TUNA_JOURNAL_MS - editorClockMs();
+    return left < 0 ? 0 : (int)left;
+}
+
+static void journalBase(struct journalHeader *h){
+    struct stat st;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, journal_magic, sizeof(journal_magic));
+    if(stat(B->filename, &st) == 0){
+        h->size = st.st_size;
+        h->mtime = st.st_mtim.tv_sec;
+        h->mtime_nsec = st.st_mtim.tv_nsec;
+    }
+}
+
+static int journalWrite(int fd, const char *s, size_t len){
+    while(len > 0){
+        ssize_t done = write(fd, s, len);
+        if(done == -1){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        s += done;
+        len -= done;
+    }
+    return 0;
+}
+
+static long long journalCompactAt(long long bytes){
+    return bytes * 2 > TUNA_JOURNAL_COMPACT ? bytes * 2 : TUNA_JOURNAL_COMPACT;
+}
+
+/* Copies the journal from offset from on to the end of fd. */
+static int journalCopyTail(int fd, long long from){
+    char buf[1 << 16];
+    int in = open(B->journal.path, O_RDONLY | O_CLOEXEC);
+    if(in == -1) return -1;
+    int failed = 0;
+    while(!failed && from < B->journal.size){
+        ssize_t got = pread(in, buf, sizeof(buf), from);
+        if(got == -1 && errno == EINTR) continue;
+        failed = got <= 0 || journalWrite(fd, buf, got) == -1;
+        from += got;
+    }
+    close(in);
+    return failed ? -1 : 0;
+}
+
+static int journalCreate(){
+    struct journalHeader h;
+    free(B->journal.path);
+    B->journal.path = journalPath(B->filename);
+    B->journal.fd = open(B->journal.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(B->journal.fd == -1) return -1;
+    journalBase(&h);
+    if(journalWrite(B->journal.fd, (char *)&h, sizeof(h)) == -1) return -1;
+    B->journal.size = sizeof(h);
+    B->journal.compact_at = journalCompactAt(h.size);
+    return 0;
+}
+
+/*
+ * Starts a child writing a header and one 'S' record holding the buffer as
+ * it is now to a temporary file, the same way a save is written. The child
+ * exits with 0 or the errno it failed with, and the SIGCHLD that follows
+ * wakes the event loop. Records journalled from B->journal.size on are
+ * added by journalCompactPoll.
+ */
+static void journalCompactStart(){
+    struct journalHeader h;
+    char head[32];
+    long long total = 0;
+    int len;
+
+    if(B->journal.compact_pid) return;
+    editorGapClose();
+    for(rowLeaf *leaf = rowStoreFirst(); leaf; leaf = leaf->next){
+        for(int j = 0; j < leaf->h.n; j++){
+            rowStoreLine(leaf, j, &len);
+            total += len + 1;
+        }
+    }
+
+    char *path = journalPath(B->filename);
+    size_t pathlen = strlen(path) + 8;
+    char *tmp = malloc(pathlen);
+    snprintf(tmp, pathlen, "%s.XXXXXX", path);
+    free(path);
+    int fd = mkstemp(tmp);
+    pid_t pid = fd == -1 ? -1 : fork();
+    if(pid == 0){
+        struct saveWriter *w = malloc(sizeof(struct saveWriter));
+        w->fd = fd;
+        w->n = 0;
+        w->total = 0;
+        journalBase(&h);
+        int failed = saveAppend(w, (char *)&h, sizeof(h)) == -1 ||
+                     saveAppend(w, head, journalHead(head, 'S', 0, 0, total)) == -1 ||
+                     saveRows(w) == -1;
+        _exit(failed ? (errno ? errno : EIO) : 0);
+    }
+    if(pid == -1){
+        if(fd != -1){
+            close(fd);
+            unlink(tmp);
+        }
+        free(tmp);
+        editorSetStatusMessage("Can't write journal: %s", strerror(errno));
+        B->journal.compact_at = journalCompactAt(B->journal.size);
+        return;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    B->journal.compact_pid = pid;
+    B->journal.compact_fd = fd;
+    B->journal.compact_tmp = tmp;
+    B->journal.compact_from = B->journal.size;
+}
+
+/* Drops a compaction that is still running, leaving the old journal. */
+static void journalCompactStop(){
+    if(B->journal.compact_pid == 0) return;
+    kill(B->journal.compact_pid, SIGKILL);
+    waitpid(B->journal.compact_pid, NULL, 0);
+    close(B->journal.compact_fd);
+    unlink(B->journal.compact_tmp);
+    free(B->journal.compact_tmp);
+    B->journal.compact_pid = 0;
+    B->journal.compact_tmp = NULL;
+}
+
+/* Swaps in the journal a finished compaction wrote. */
+static void journalCompactFinish(int status){
+    struct editorJournal *j = &B->journal;
+    int fd = j->compact_fd;
+    int err = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    long long snapshot = err ? -1 : lseek(fd, 0, SEEK_END);
+    int failed = err || snapshot == -1 || journalCopyTail(fd, j->compact_from) == -1 ||
+                 rename(j->compact_tmp, j->path) == -1;
+    if(failed){
+        if(err == -1) editorSetStatusMessage("Can't write journal: compaction killed by %s", strsignal(WTERMSIG(status)));
+        else editorSetStatusMessage("Can't write journal: %s", strerror(err ? err : errno));
+        close(fd);
+        unlink(j->compact_tmp);
+        j->compact_at = journalCompactAt(j->size);
+    }else{
+        close(j->fd);
+        j->fd = fd;
+        j->size = snapshot + j->size - j->compact_from;
+        j->compact_at = journalCompactAt(snapshot);
+        j->save_from = -1;
+    }
+    free(j->compact_tmp);
+    j->compact_pid = 0;
+    j->compact_tmp = NULL;
+}
+
+void journalCompactPoll(){
+    struct editorBuffer *active = B;
+    int status;
+    for(int i = 0; i < E.nbuffers; i++){
+        B = E.buffers[i];
+        if(B->journal.compact_pid && waitpid(B->journal.compact_pid, &status, WNOHANG) == B->journal.compact_pid)
+            journalCompactFinish(status);
+    }
+    B = active;
+}
+
+void journalFlush(){
+    journalEndRun();
+    B->journal.since = 0;
+    if(B->journal.len == 0) return;
+    if(B->journal.fd == -1 && journalCreate() == -1){
+        editorSetStatusMessage("Can't write journal: %s", strerror(errno));
+        B->journal.len = 0;
+        return;
+    }
+    if(journalWrite(B->journal.fd, B->journal.buf, B->journal.len) == -1){
+        editorSetStatusMessage("Can't write journal: %s", strerror(errno));
+    }
+    B->journal.size += B->journal.len;
+    B->journal.len = 0;
+    if(B->journal.size >= B->journal.compact_at && B->load == NULL) journalCompactStart();
+}
+
+void journalDiscard(){
+    journalCompactStop();
+    if(B->journal.fd != -1){
+        close(B->journal.fd);
+        B->journal.fd = -1;
+        unlink(B->journal.path);
+    }
+    B->journal.len = 0;
+    B->journal.run = 0;
+    B->journal.since = 0;
+    B->journal.size = 0;
+    B->journal.compact_at = 0;
+}
+
+/*
+ * The file on disk now matches what was journalled up to
+ * B->journal.save_from, so only the records after it are kept, behind a
+ * header for the saved file. A journal compacted during the save starts
+ * with a snapshot and is kept whole.
+ */
+void journalSaved(){
+    struct journalHeader h;
+    struct editorJournal *j = &B->journal;
+    if(!B->dirty){
+        journalDiscard();
+        return;
+    }
+    journalCompactStop();
+    if(j->fd == -1 || j->save_from < 0) return;
+
+    size_t pathlen = strlen(j->path) + 8;
+    char *tmp = malloc(pathlen);
+    snprintf(tmp, pathlen, "%s.XXXXXX", j->path);
+    int fd = mkstemp(tmp);
+    journalBase(&h);
+    if(fd == -1 || journalWrite(fd, (char *)&h, sizeof(h)) == -1 ||
+       journalCopyTail(fd, j->save_from) == -1 || rename(tmp, j->path) == -1){
+        editorSetStatusMessage("Can't write journal: %s", strerror(errno));
+        if(fd != -1){
+            close(fd);
+            unlink(tmp);
+        }
+    }else{
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        close(j->fd);
+        j->fd = fd;
+        j->size = sizeof(h) + j->size - j->save_from;
+        j->compact_at = journalCompactAt(h.size);
+    }
+    free(tmp);
+}
+
+static int journalNumber(char **p, char *end, long long *v){
+    unsigned long long x = 0;
+    for(int shift = 0; *p < end && shift < 64; shift += 7){
+        unsigned char c = *(*p)++;
+        x |= (unsigned long long)(c & 0x7f) << shift;
+        if(!(c & 0x80)){
+            *v = x;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Applies records until the end of the journal or the first one that is
+ * cut short or doesn't fit the buffer, and returns how many were applied.
+ * *good is left at the end of the last record applied.
+ */
+static int journalReplay(char *buf, long long len, long long *good){
+    char *p = buf + sizeof(struct journalHeader);
+    char *end = buf + len;
+    int n = 0;
+    while(p < end){
+        char type = *p;
+        char *q = p + 1;
+        long long row, col, rlen;
+        if(journalNumber(&q, end, &row) == -1 || journalNumber(&q, end, &col) == -1 ||
+           journalNumber(&q, end, &rlen) == -1) break;
+        if(type != 'D' && rlen > end - q) break;
+
+        if(type == 'S'){
+            editorClear();
+            char *line = q;
+            for(char *nl; line < q + rlen && (nl = memchr(line, '\n', q + rlen - line)); line = nl + 1){
+                editorInsertRow(B->numrows, line, nl - line);
+            }
+            q += rlen;
+        }else if(type == 'I' && (row < B->numrows || (row == B->numrows && col == 0)) &&
+                 (row == B->numrows || col <= editorRowAt(row)->size)){
+            B->cy = row;
+            B->cx = col;
+            editorInsertText(q, rlen);
+            q += rlen;
+        }else if(type == 'D' && row < B->numrows && col <= editorRowAt(row)->size){
+            editorDeleteText(row, col, rlen);
+        }else{
+            break;
+        }
+        p = q;
+        n++;
+    }
+    *good = p - buf;
+    return n;
+}
+
+/*
+ * Called by editorOpen once the file is loaded. A journal left behind by
+ * an editor that never saved or quit is offered for replay, as long as it
+ * was written against this version of the file or starts with a snapshot.
+ */
+void journalRecover(){
+    struct journalHeader h, base;
+    struct stat st;
+    if(E.batch) return;     /* leave it for the next interactive open */
+    char *path = journalPath(B->filename);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if(fd == -1 || fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(h)){
+        if(fd != -1) close(fd);
+        free(path);
+        return;
+    }
+    char *buf = malloc(st.st_size);
+    long long len = 0;
+    while(len < st.st_size){
+        ssize_t got = read(fd, buf + len, st.st_size - len);
+        if(got == -1 && errno == EINTR) continue;
+        if(got <= 0) break;
+        len += got;
+    }
+    memcpy(&h, buf, sizeof(h));
+    journalBase(&base);
+    int current = h.size == base.size && h.mtime == base.mtime && h.mtime_nsec == base.mtime_nsec;
+    int snapshot = len > (long long)sizeof(h) && buf[sizeof(h)] == 'S';
+
+    int c = 0;
+    if(memcmp(h.magic, journal_magic, sizeof(journal_magic)) != 0){
+        editorSetStatusMessage("Ignoring %s: not a tuna journal", path);
+    }else if(len == sizeof(h)){
+        unlink(path);
+    }else if(!current && !snapshot){
+        editorSetStatusMessage("Ignoring %s: the file changed after it was written", path);
+    }else{
+        editorSetStatusMessage("Found unsaved changes from an earlier session. Recover them? (y/n)");
+        editorRefreshScreen();
+        do c = editorReadKey(); while(c != 'y' && c != 'Y' && c != 'n' && c != 'N' && c != '\x1b');
+    }
+
+    if(c == 'y' || c == 'Y'){
+        long long good;
+        editorLoadWait(INT_MAX);
+        B->journal.off = 1;
+        int n = journalReplay(buf, len, &good);
+        B->journal.off = 0;
+        B->cx = B->cy = 0;
+        B->dirty = n;
+        B->undo.saved = -1;
+        if(good < len) ftruncate(fd, good);
+        lseek(fd, good, SEEK_SET);
+        B->journal.fd = fd;
+        free(B->journal.path);
+        B->journal.path = path;
+        B->journal.size = good;
+        B->journal.compact_at = journalCompactAt(base.size);
+        fd = -1;
+        path = NULL;
+        editorSetStatusMessage("Recovered %d edits from the journal", n);
+    }else if(c){
+        unlink(path);
+        editorSetStatusMessage("Journal discarded");
+    }
+    if(fd != -1) close(fd);
+    free(path);
+    free(buf);
+}
+
 /* Open Files */
 
 void editorOpenFileMenu(){
@@ -859,97 +3960,553 @@ char *editorPromptInput(){
 		editorSetStatusMessage("%s", buf);
 		int c = editorReadKey();
 
-		if(c == '\r'){
-			if(buflen != 0){
-				buf[buflen] = '\0';
-				return buf;
-			}
-		}else if(!iscntrl(c) && c < 128){
-			if(buflen == bufsize - 1){
-				bufsize *= 2;
-				buf = realloc(buf, bufsize);
-			}
-			buf[buflen++] = c;
-		}
-	}
+		if(c == '\r'){
+			if(buflen != 0){
+				buf[buflen] = '\0';
+				return buf;
+			}
+		}else if(!iscntrl(c) && c < 128){
+			if(buflen == bufsize - 1){
+				bufsize *= 2;
+				buf = realloc(buf, bufsize);
+			}
+			buf[buflen++] = c;
+		}
+	}
+}
+
+/* Buffers */
+
+/*
+ * Buffers are listed in the order they were opened, which is what Ctrl-N
+ * and Ctrl-P walk. Separately each one remembers when it was last active,
+ * and once the buffers together hold more than TUNA_BUFFER_CACHE rendered
+ * rows the coldest ones lose their render and highlight caches first. The
+ * highlight state carried between rows is kept, so a cold buffer only
+ * re-renders what comes on screen when it is switched back to.
+ */
+
+struct editorBuffer *bufferNew(){
+    struct editorBuffer *b = calloc(1, sizeof(struct editorBuffer));
+    if(b == NULL) die("calloc");
+    b->journal.fd = -1;
+    E.buffers = realloc(E.buffers, sizeof(struct editorBuffer *) * (E.nbuffers + 1));
+    if(E.buffers == NULL) die("realloc");
+    E.buffers[E.nbuffers++] = b;
+    return b;
+}
+
+static void bufferTrim(){
+    int total = 0;
+    for(int i = 0; i < E.nbuffers; i++) total += E.buffers[i]->cached_rows;
+    struct editorBuffer *active = B;
+    while(total > TUNA_BUFFER_CACHE){
+        struct editorBuffer *cold = NULL;
+        for(int i = 0; i < E.nbuffers; i++){
+            struct editorBuffer *b = E.buffers[i];
+            if(b != active && b->cached_rows && (cold == NULL || b->used < cold->used)) cold = b;
+        }
+        if(cold == NULL) break;
+        total -= cold->cached_rows;
+        B = cold;
+        editorRowEvict(0, 0);
+        B = active;
+    }
+}
+
+void bufferSwitch(struct editorBuffer *b){
+    if(b == B) return;
+    editorSearchReset(&E.search);
+    if(B){
+        editorGapClose();
+        journalFlush();
+    }
+    B = b;
+    B->used = ++E.tick;
+    editorScreenInvalidate();
+    bufferTrim();
+}
+
+struct editorBuffer *bufferFind(const char *path){
+    struct editorBuffer *found = NULL;
+    char *want = realpath(path, NULL);
+    if(want == NULL) return NULL;
+    for(int i = 0; i < E.nbuffers && found == NULL; i++){
+        if(E.buffers[i]->filename == NULL) continue;
+        char *have = realpath(E.buffers[i]->filename, NULL);
+        if(have && strcmp(have, want) == 0) found = E.buffers[i];
+        free(have);
+    }
+    free(want);
+    return found;
+}
+
+void bufferFree(struct editorBuffer *b){
+    struct editorBuffer *active = B;
+    B = b;
+    editorLoadCancel(b);
+    editorGapClose();
+    journalDiscard();
+    editorClear();
+    free(B->journal.buf);
+    free(B->journal.run_text);
+    free(B->journal.path);
+    free(B->undo.rec);
+    free(B->filename);
+    B = active;
+    free(b);
+}
+
+static int bufferIndex(struct editorBuffer *b){
+    for(int i = 0; i < E.nbuffers; i++){
+        if(E.buffers[i] == b) return i;
+    }
+    return -1;
+}
+
+static void bufferAnnounce(){
+    editorSetStatusMessage("Buffer %d/%d: %s", bufferIndex(B) + 1, E.nbuffers, B->filename ? B->filename : "[No Name]");
+}
+
+void editorBufferNext(int step){
+    if(E.nbuffers < 2) return;
+    int at = (bufferIndex(B) + step + E.nbuffers) % E.nbuffers;
+    bufferSwitch(E.buffers[at]);
+    bufferAnnounce();
+}
+
+/* Lists the buffers in the status bar and switches on a digit. */
+void editorBufferList(){
+    char list[80];
+    int len = 0;
+    for(int i = 0; i < E.nbuffers && i < 9 && len < (int)sizeof(list); i++){
+        struct editorBuffer *b = E.buffers[i];
+        char *name = b->filename ? strrchr(b->filename, '/') : NULL;
+        name = name ? name + 1 : (b->filename ? b->filename : "[No Name]");
+        len += snprintf(&list[len], sizeof(list) - len, "%s%s%d:%s%s", i ? " " : "", b == B ? ">" : "", i + 1, name, b->dirty ? "*" : "");
+    }
+    editorSetStatusMessage("%s", list);
+    editorRefreshScreen();
+
+    int c = editorReadKey();
+    if(c >= '1' && c <= '9' && c - '1' < E.nbuffers){
+        bufferSwitch(E.buffers[c - '1']);
+        bufferAnnounce();
+    }else{
+        editorSetStatusMessage("");
+    }
+}
+
+void editorBufferClose(){
+    if(B->dirty){
+        editorSetStatusMessage("Unsaved Changes! Save (CTRL-S) before closing the buffer.");
+        return;
+    }
+    if(E.save_buf == B) editorSaveWait();
+
+    struct editorBuffer *closing = B, *next = NULL;
+    int at = bufferIndex(closing);
+    memmove(&E.buffers[at], &E.buffers[at + 1], sizeof(struct editorBuffer *) * (E.nbuffers - at - 1));
+    E.nbuffers--;
+    for(int i = 0; i < E.nbuffers; i++){
+        if(next == NULL || E.buffers[i]->used > next->used) next = E.buffers[i];
+    }
+    bufferSwitch(next ? next : bufferNew());
+    bufferFree(closing);
+    bufferAnnounce();
+}
+
+/* Search */
+
+/*
+ * Search works on the raw row text rather than render, so rows it only
+ * passes over never get render/spans built. Candidates come from a filter on
+ * the first and last byte of the query, 16 or 32 positions at a time, and
+ * are confirmed with a full compare; mapped leaves are scanned as one span
+ * straight out of the mapping. All matches are kept in row/column order.
+ * A longer query can only match where the shorter one did, so when the
+ * query grows the old matches are filtered instead of rescanning.
+ * The search is case-insensitive unless the query has an uppercase letter.
+ *
+ * The scan runs on a worker thread over a snapshot of the leaf list taken
+ * when it starts. While the file is still loading, leaves the loader hands
+ * over are added to the end of the snapshot and the worker waits for them
+ * once it runs out. Nothing can be edited while the prompt is up, and mapped
+ * leaves materialized by drawing in the meantime are retired instead of
+ * freed until the worker is gone. Matches are published in batches under
+ * s->lock; the UI only ever reads them, and a new query cancels the
+ * running scan before starting the next one.
+ */
+
+static int searchEqual(const char *text, const char *q, int len, int icase){
+    if(!icase) return memcmp(text, q, len) == 0;
+    for(int i = 0; i < len; i++)
+        if(tolower((unsigned char)text[i]) != (unsigned char)q[i]) return 0;
+    return 1;
+}
+
+static size_t searchNext(const char *text, size_t len, size_t i, const char *q, int qlen, int icase){
+    if(len < (size_t)qlen) return len;
+    unsigned char first = q[0], last = q[qlen - 1];
+    unsigned char ffold = icase && isalpha(first) ? 0x20 : 0;
+    unsigned char lfold = icase && isalpha(last) ? 0x20 : 0;
+    size_t end = len - qlen + 1;
+
+#if defined(__AVX2__)
+    const __m256i vf = _mm256_set1_epi8(first), vl = _mm256_set1_epi8(last);
+    const __m256i mf = _mm256_set1_epi8(ffold), ml = _mm256_set1_epi8(lfold);
+    for(; i + 32 <= end; i += 32){
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(text + i)), mf);
+        __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(text + i + qlen - 1)), ml);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, vf), _mm256_cmpeq_epi8(b, vl)));
+        while(mask){
+            size_t at = i + __builtin_ctz(mask);
+            if(searchEqual(text + at, q, qlen, icase)) return at;
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i vf = _mm_set1_epi8(first), vl = _mm_set1_epi8(last);
+    const __m128i mf = _mm_set1_epi8(ffold), ml = _mm_set1_epi8(lfold);
+    for(; i + 16 <= end; i += 16){
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(text + i)), mf);
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(text + i + qlen - 1)), ml);
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, vf), _mm_cmpeq_epi8(b, vl)));
+        while(mask){
+            size_t at = i + __builtin_ctz(mask);
+            if(searchEqual(text + at, q, qlen, icase)) return at;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for(; i < end; i++){
+        if(((unsigned char)text[i] | ffold) != first) continue;
+        if(((unsigned char)text[i + qlen - 1] | lfold) != last) continue;
+        if(searchEqual(text + i, q, qlen, icase)) return i;
+    }
+    return len;
+}
+
+static int searchStopped(struct editorSearch *s){
+    return s->capped || __atomic_load_n(&s->cancel, __ATOMIC_RELAXED);
+}
+
+static void searchFlush(struct editorSearch *s){
+    if(s->nbatch == 0) return;
+    long long now = editorClockMs();
+    if(now - s->woken >= TUNA_FRAME_MS){
+        s->woken = now;
+        editorWake();
+    }
+    pthread_mutex_lock(&s->lock);
+    int take = s->nbatch;
+    if(take > TUNA_SEARCH_MAX - s->n){
+        take = TUNA_SEARCH_MAX - s->n;
+        s->capped = 1;
+    }
+    if(s->n + take > s->cap){
+        while(s->n + take > s->cap) s->cap = s->cap ? s->cap * 2 : 256;
+        s->m = realloc(s->m, sizeof(searchMatch) * s->cap);
+    }
+    memcpy(&s->m[s->n], s->batch, sizeof(searchMatch) * take);
+    s->n += take;
+    pthread_mutex_unlock(&s->lock);
+    s->nbatch = 0;
+}
+
+static void searchAdd(struct editorSearch *s, int row, int col){
+    s->batch[s->nbatch].row = row;
+    s->batch[s->nbatch].col = col;
+    if(++s->nbatch == TUNA_SEARCH_BATCH) searchFlush(s);
+}
+
+static void searchScan(struct editorSearch *s){
+    for(int k = 0; !searchStopped(s); k++){
+        pthread_mutex_lock(&s->lock);
+        while(k == s->nsnap && !s->last && !searchStopped(s)) pthread_cond_wait(&s->more, &s->lock);
+        struct searchSpan span = k < s->nsnap ? s->snap[k] : (struct searchSpan){NULL, 0};
+        pthread_mutex_unlock(&s->lock);
+        if(span.leaf == NULL) break;
+        rowLeaf *leaf = span.leaf;
+        int row = span.base;
+        if(leaf->h.leaf == ROW_LEAF_MAPPED){
+            rowMapLeaf *ml = (rowMapLeaf *)leaf;
+            const char *text = s->map + ml->base;
+            size_t len = ml->nl[ml->h.n - 1];
+            size_t at = 0;
+            int i = 0;
+            while((at = searchNext(text, len, at, s->query, s->len, s->icase)) < len){
+                while(ml->nl[i] <= at) i++;
+                searchAdd(s, row + i, at - (i ? ml->nl[i - 1] + 1 : 0));
+                at++;
+            }
+        }else{
+            for(int i = 0; i < leaf->h.n; i++){
+                erow *r = &leaf->rows[i];
+                size_t at = 0;
+                while((at = searchNext(r->chars, r->size, at, s->query, s->len, s->icase)) < (size_t)r->size){
+                    searchAdd(s, row + i, at);
+                    at++;
+                }
+            }
+        }
+        searchFlush(s);
+    }
+}
+
+static void searchRefine(struct editorSearch *s){
+    int k = 0;
+    for(int i = 0; i < s->nsrc && !searchStopped(s); i++){
+        searchMatch m = s->src[i];
+        if(m.row >= s->snap[k].base + s->snap[k].leaf->h.n){
+            searchFlush(s);
+            while(m.row >= s->snap[k].base + s->snap[k].leaf->h.n) k++;
+        }
+        int len;
+        char *text = rowStoreLine(s->snap[k].leaf, m.row - s->snap[k].base, &len);
+        if(m.col + s->len <= len && searchEqual(text + m.col, s->query, s->len, s->icase)) searchAdd(s, m.row, m.col);
+    }
+    searchFlush(s);
+}
+
+static void *searchWorker(void *arg){
+    struct editorSearch *s = arg;
+    long long start = editorClockUs();
+    traceThread("search");
+    if(s->src) searchRefine(s);
+    else searchScan(s);
+    free(s->src);
+    s->src = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    s->complete = !searchStopped(s);
+    s->done = 1;
+    traceSpan("search", "searchWorker", start, "matches", s->n);
+    pthread_mutex_unlock(&s->lock);
+    editorWake();
+    return NULL;
+}
+
+/* Adds the chain of leaves from first on to the snapshot. */
+static void searchSnapshot(struct editorSearch *s, rowLeaf *first){
+    for(rowLeaf *leaf = first; leaf; leaf = leaf->next){
+        if(s->nsnap == s->capsnap){
+            s->capsnap = s->capsnap ? s->capsnap * 2 : 64;
+            s->snap = realloc(s->snap, sizeof(struct searchSpan) * s->capsnap);
+        }
+        s->snap[s->nsnap].leaf = leaf;
+        s->snap[s->nsnap].base = s->rows;
+        s->nsnap++;
+        s->rows += leaf->h.n;
+    }
+}
+
+/* Called by loadTake with the leaves it appended; last once the whole
+ * file is in. */
+void editorSearchExtend(struct editorSearch *s, rowLeaf *first, int last){
+    if(!s->running) return;
+    pthread_mutex_lock(&s->lock);
+    searchSnapshot(s, first);
+    s->last = last;
+    pthread_cond_signal(&s->more);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void searchJoin(struct editorSearch *s){
+    if(s->running){
+        pthread_join(s->thread, NULL);
+        s->running = 0;
+        s->cancel = 0;
+    }
+    while(s->retired){
+        rowLeaf *leaf = s->retired;
+        s->retired = leaf->prev;
+        free(leaf);
+    }
+}
+
+void editorSearchStop(struct editorSearch *s){
+    if(s->running){
+        pthread_mutex_lock(&s->lock);
+        __atomic_store_n(&s->cancel, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&s->more);
+        pthread_mutex_unlock(&s->lock);
+    }
+    searchJoin(s);
+}
+
+/* Waits for the scan to reach the end of the file, loading the rest of it
+ * first if need be. */
+static void searchFinish(struct editorSearch *s){
+    editorLoadWait(INT_MAX);
+    searchJoin(s);
 }
 
-void editorSavePrompt(){
-	editorSetStatusMessage("You have unsaved changes. Save them? (y/n)");
-	int c = editorReadKey();
-	if(c == 'y' || c == 'Y'){
-		editorSave();
-	}
+int editorSearchStart(struct editorSearch *s, const char *query, int row, int col){
+    int len = strlen(query);
+    int icase = 1;
+    for(int i = 0; i < len; i++)
+        if(isupper((unsigned char)query[i])) icase = 0;
+    if(s->query && len == s->len && icase == s->icase && searchEqual(query, s->query, len, icase)) return 0;
+
+    editorSearchStop(s);
+    int refine = s->query && s->complete && s->len > 0 && len > s->len && (s->icase || !icase) &&
+        searchEqual(query, s->query, s->len, s->icase);
+
+    free(s->query);
+    s->query = malloc(len + 1);
+    for(int i = 0; i <= len; i++) s->query[i] = icase ? tolower((unsigned char)query[i]) : query[i];
+    s->len = len;
+    s->icase = icase;
+    s->anchor_row = row;
+    s->anchor_col = col;
+    s->current = -1;
+
+    if(refine){
+        s->src = s->m;
+        s->nsrc = s->n;
+        s->m = NULL;
+        s->cap = 0;
+    }
+    s->n = 0;
+    s->seen = 0;
+    s->capped = 0;
+    s->done = 0;
+    s->complete = 0;
+    if(len == 0){
+        s->done = 1;
+        s->complete = 1;
+        return 1;
+    }
+
+    editorGapClose();
+    s->nsnap = s->rows = 0;
+    s->map = B->map;
+    searchSnapshot(s, rowStoreFirst());
+    s->last = B->load == NULL;
+    s->running = 1;
+    if(pthread_create(&s->thread, NULL, searchWorker, s) != 0){
+        editorLoadWait(INT_MAX);
+        s->running = 0;
+        searchWorker(s);
+    }
+    return 1;
 }
 
-/* Find */
+int editorSearchPoll(struct editorSearch *s){
+    if(!s->running) return 0;
+    pthread_mutex_lock(&s->lock);
+    int n = s->n, done = s->done;
+    pthread_mutex_unlock(&s->lock);
+    if(done) editorSearchStop(s);
+    if(n == s->seen && !done) return 0;
+    s->seen = n;
+    return 1;
+}
 
-void editorFindCallback(char *query, int key){
-    static int last_match = -1;
-    static int direction = 1;
+static int searchLower(struct editorSearch *s, int row, int col){
+    int lo = 0, hi = s->n;
+    while(lo < hi){
+        int mid = lo + (hi - lo) / 2;
+        if(s->m[mid].row < row || (s->m[mid].row == row && s->m[mid].col < col)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
+int editorSearchRow(struct editorSearch *s, int row){
+    return searchLower(s, row, 0);
+}
 
-    if(saved_hl){
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+int editorSearchRx(erow *row, struct searchCursor *c, int cx){
+    while(c->cx < cx && c->cx < row->size){
+        if(editorRowChar(row, c->cx) == '\t')
+            c->rx += (TUNA_TAB_STOP - 1) - (c->rx % TUNA_TAB_STOP);
+        c->rx++;
+        c->cx++;
     }
+    return c->rx;
+}
+
+void editorSearchReset(struct editorSearch *s){
+    editorSearchStop(s);
+    free(s->query);
+    free(s->m);
+    free(s->src);
+    free(s->snap);
+    s->query = NULL;
+    s->len = 0;
+    s->m = NULL;
+    s->n = s->cap = 0;
+    s->src = NULL;
+    s->nsrc = 0;
+    s->snap = NULL;
+    s->nsnap = s->capsnap = 0;
+    s->current = -1;
+    s->done = s->complete = 0;
+}
+
+/* Find */
 
+static void editorFindStep(char *query, int key){
+    struct editorSearch *s = &E.search;
     if(key == '\r' || key == '\x1b'){
-        last_match = -1;
-        direction = 1;
+        editorSearchReset(s);
         return;
-    }else if(key == ARROW_RIGHT || key == ARROW_DOWN){
-        direction = 1;
-    }else if(key == ARROW_LEFT || key == ARROW_UP){
-        direction = -1;
-    }else{
-        last_match = -1;
-        direction = 1;
     }
 
-    if(last_match == -1) direction = 1;
-    int current = last_match;
-    int i;
-    for(i = 0; i < E.numrows; i++){
-        current += direction;
-        if(current == -1) current = E.numrows -1;
-        else if(current == E.numrows) current = 0;
-
-        erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        if(match){
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.numrows;
-
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
+    int step = 0;
+    if(key == ARROW_RIGHT || key == ARROW_DOWN) step = 1;
+    else if(key == ARROW_LEFT || key == ARROW_UP) step = -1;
+    else if(key != SEARCH_PROGRESS) editorSearchStart(s, query, B->cy, B->cx);
+
+    /* Wrapping around has to know where the last match is */
+    pthread_mutex_lock(&s->lock);
+    int wrap = step && s->current != -1 && !s->done && (s->current + step < 0 || s->current + step >= s->n);
+    pthread_mutex_unlock(&s->lock);
+    if(wrap) searchFinish(s);
+
+    pthread_mutex_lock(&s->lock);
+    if(s->current == -1){
+        int at = searchLower(s, s->anchor_row, s->anchor_col);
+        if(at < s->n) s->current = at;
+        else if(s->done && s->n) s->current = 0;
+    }
+    if(s->current != -1 && step) s->current = (s->current + step + s->n) % s->n;
+    if(s->current == -1){
+        pthread_mutex_unlock(&s->lock);
+        return;
     }
+    searchMatch m = s->m[s->current];
+    pthread_mutex_unlock(&s->lock);
+
+    B->cy = m.row;
+    B->cx = m.col;
+    B->rowoff = B->numrows;
+}
+
+void editorFindCallback(char *query, int key){
+    long long start = editorClockUs();
+    editorFindStep(query, key);
+    traceSpan("search", "editorFindCallback", start, "key", key);
 }
 
 void editorFind(){
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
+    int saved_cx = B->cx;
+    int saved_cy = B->cy;
+    int saved_coloff = B->coloff;
+    int saved_rowoff = B->rowoff;
 
     char *query = editorPrompt("Search: %s (ESC/Arrows/Enter)", editorFindCallback);
 
     if(query){
         free(query);
     }else{
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.coloff = saved_coloff;
-        E.rowoff = saved_coloff;
+        B->cx = saved_cx;
+        B->cy = saved_cy;
+        B->coloff = saved_coloff;
+        B->rowoff = saved_coloff;
     }
 }
 
@@ -963,184 +4520,448 @@ void editorTerminal(){
 
 	system(command);
 	free(command); 
+	editorScreenInvalidate();
 }
 
 /* Append Buffer */
 
+/*
+ * The frame buffer lives across frames and only ever grows, doubling when
+ * it runs out, so once it has seen the largest frame no more allocations
+ * happen while drawing. E.screen.allocs counts every allocation made on
+ * the output path.
+ */
+
 struct abuf{
     char *b;
     int len;
+    int cap;
 };
 
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
+
+static void abGrow(struct abuf *ab, int need){
+    if(ab->len + need <= ab->cap) return;
+    int cap = ab->cap ? ab->cap : 4096;
+    while(cap < ab->len + need) cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if(new == NULL) die("realloc");
+    ab->b = new;
+    ab->cap = cap;
+    E.screen.allocs++;
+}
 
 void abAppend(struct abuf *ab, const char *s, int len){
-    char *new = realloc(ab->b, ab->len + len);
+    abGrow(ab, len);
+    memcpy(&ab->b[ab->len], s, len);
+    ab->len += len;
+}
 
-    if(new == NULL) return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
+char *abReserve(struct abuf *ab, int len){
+    abGrow(ab, len);
     ab->len += len;
+    return &ab->b[ab->len - len];
 }
 
 void abFree(struct abuf *ab){
     free(ab->b);
+    ab->b = NULL;
+    ab->len = ab->cap = 0;
+}
+
+/* Screen */
+
+/*
+ * Frames are drawn into a grid of cells, a character plus its colour, and
+ * never straight to the terminal. The grid of the previous frame is kept
+ * as a shadow of what the terminal shows, and only runs of cells that
+ * differ from it are written out, each behind a cursor move. Short stretches
+ * of unchanged cells inside a run are rewritten rather than skipped, since
+ * a cursor move costs more than a few characters, and a line whose new tail
+ * is blank is finished with an erase. When the view scrolled, the text area
+ * is scrolled on the terminal with a scroll region first and the shadow is
+ * shifted to match, so only the lines that came into view are sent.
+ */
+
+#define SCREEN_RUN_GAP 6
+
+static void screenBlank(screenCell *c, int n){
+    for(int i = 0; i < n; i++){
+        c[i].ch = ' ';
+        c[i].attr = 0;
+    }
+}
+
+void screenResize(){
+    struct editorScreen *S = &E.screen;
+    int rows = E.screenrows + 2, cols = E.screencols;
+    if(S->cur && S->rows == rows && S->cols == cols) return;
+    free(S->cur);
+    free(S->prev);
+    S->rows = rows;
+    S->cols = cols;
+    S->cur = malloc(sizeof(screenCell) * rows * cols);
+    S->prev = malloc(sizeof(screenCell) * rows * cols);
+    if(S->cur == NULL || S->prev == NULL) die("malloc");
+    S->allocs += 2;
+    S->valid = 0;
+}
+
+void screenPut(int y, int x, char ch, int attr){
+    struct editorScreen *S = &E.screen;
+    if(y < 0 || y >= S->rows || x < 0 || x >= S->cols) return;
+    S->cur[y * S->cols + x].ch = ch;
+    S->cur[y * S->cols + x].attr = attr;
+}
+
+void screenPuts(int y, int x, const char *s, int len, int attr){
+    for(int i = 0; i < len; i++) screenPut(y, x + i, s[i], attr);
+}
+
+/* Like screenPuts for row text, showing control characters inverted */
+void screenText(int y, int x, const char *s, int len, int attr){
+    struct editorScreen *S = &E.screen;
+    if(y < 0 || y >= S->rows || x < 0) return;
+    if(len > S->cols - x) len = S->cols - x;
+    screenCell *cell = &S->cur[y * S->cols + x];
+    for(int i = 0; i < len; i++){
+        if(iscntrl(s[i])){
+            cell[i].ch = (s[i] <= 26) ? '@' + s[i] : '?';
+            cell[i].attr = SCREEN_INVERSE;
+        }else{
+            cell[i].ch = s[i];
+            cell[i].attr = attr;
+        }
+    }
+}
+
+void editorScreenInvalidate(){
+    E.screen.valid = 0;
+}
+
+static char screen_sgr[256][12];
+static unsigned char screen_sgr_len[256];
+
+void screenInitSGR(){
+    for(int attr = 0; attr < 256; attr++){
+        int color = attr & ~SCREEN_INVERSE;
+        if(attr == 0)
+            screen_sgr_len[attr] = snprintf(screen_sgr[attr], sizeof(screen_sgr[attr]), "\x1b[m");
+        else
+            screen_sgr_len[attr] = snprintf(screen_sgr[attr], sizeof(screen_sgr[attr]), "\x1b[%d;%dm", attr & SCREEN_INVERSE ? 7 : 27, color ? color : 39);
+    }
+}
+
+static void screenAttr(struct abuf *ab, int *cur, int attr){
+    if(*cur == attr) return;
+    abAppend(ab, screen_sgr[attr], screen_sgr_len[attr]);
+    *cur = attr;
+}
+
+static void screenEmit(struct abuf *ab, int *attr, screenCell *c, int from, int to){
+    while(from < to){
+        int run = from;
+        while(run < to && c[run].attr == c[from].attr) run++;
+        screenAttr(ab, attr, c[from].attr);
+        char *out = abReserve(ab, run - from);
+        for(int j = from; j < run; j++) *out++ = c[j].ch;
+        from = run;
+    }
+}
+
+static void screenScroll(struct abuf *ab, int d){
+    struct editorScreen *S = &E.screen;
+    int n = E.screenrows, cols = S->cols;
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", n, d > 0 ? d : -d, d > 0 ? 'S' : 'T');
+    abAppend(ab, buf, len);
+    if(d > 0){
+        memmove(S->prev, &S->prev[d * cols], sizeof(screenCell) * (n - d) * cols);
+        screenBlank(&S->prev[(n - d) * cols], d * cols);
+    }else{
+        d = -d;
+        memmove(&S->prev[d * cols], S->prev, sizeof(screenCell) * (n - d) * cols);
+        screenBlank(S->prev, d * cols);
+    }
+}
+
+static inline int screenSame(screenCell *a, screenCell *b){
+    return a->ch == b->ch && a->attr == b->attr;
+}
+
+static void screenMove(struct abuf *ab, int y, int x){
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    abAppend(ab, buf, len);
+}
+
+void editorScreenFlush(struct abuf *ab, int cy, int cx){
+    struct editorScreen *S = &E.screen;
+    int cols = S->cols;
+    int attr = 0;
+    int ty = -1, tx = -1;
+
+    abAppend(ab, "\x1b[?25l", 6);
+    int start = ab->len;
+    if(!S->valid){
+        abAppend(ab, "\x1b[2J", 4);
+        screenBlank(S->prev, S->rows * cols);
+        S->valid = 1;
+    }else if(B->rowoff != S->rowoff && abs(B->rowoff - S->rowoff) < E.screenrows){
+        screenScroll(ab, B->rowoff - S->rowoff);
+    }
+    S->rowoff = B->rowoff;
+
+    for(int y = 0; y < S->rows; y++){
+        screenCell *c = &S->cur[y * cols], *p = &S->prev[y * cols];
+        int tail = cols;
+        while(tail > 0 && c[tail - 1].ch == ' ' && c[tail - 1].attr == 0) tail--;
+
+        /* Multi-byte characters don't take one column per byte, so rows
+         * holding them are always rewritten from the start. */
+        int whole = 0;
+        for(int x = 0; x < cols && !whole; x++)
+            if((c[x].ch | p[x].ch) & 0x80) whole = 1;
+
+        int x = 0;
+        while(x < cols){
+            if(!whole && screenSame(&c[x], &p[x])){
+                x++;
+                continue;
+            }
+            int last = x;
+            for(int e = x + 1; e < cols && e - last <= SCREEN_RUN_GAP; e++)
+                if(whole || !screenSame(&c[e], &p[e])) last = e;
+
+            if(ty != y || tx != x) screenMove(ab, y, x);
+            if(last >= tail){
+                screenEmit(ab, &attr, c, x, tail);
+                screenAttr(ab, &attr, 0);
+                abAppend(ab, "\x1b[K", 3);
+                ty = -1;
+                break;
+            }
+            screenEmit(ab, &attr, c, x, last + 1);
+            x = last + 1;
+            ty = y;
+            tx = x < cols ? x : -1;
+        }
+    }
+    screenAttr(ab, &attr, 0);
+
+    if(ab->len == start && cy == S->cy && cx == S->cx){
+        ab->len = 0;
+    }else{
+        screenMove(ab, cy, cx);
+        abAppend(ab, "\x1b[?25h", 6);
+    }
+    S->cy = cy;
+    S->cx = cx;
+
+    screenCell *tmp = S->prev;
+    S->prev = S->cur;
+    S->cur = tmp;
 }
 
 /* Output */
 
 void editorScroll(){
-    E.rx = 0;
-    if(E.cy < E.numrows){
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    B->rx = 0;
+    if(B->cy < B->numrows){
+        B->rx = editorRowCxToRx(editorRowAt(B->cy), B->cx);
     }
     
-    int max_lines = E.numrows;
+    int max_lines = B->numrows;
     int max_digits = max_lines > 0 ? (int)log10(max_lines) + 1 : 1;
     int line_number_width = max_digits + 1;
 
-    if(E.rx + line_number_width < E.coloff){
-	E.rx = E.coloff - line_number_width + 1;
+    if(B->rx + line_number_width < B->coloff){
+	B->rx = B->coloff - line_number_width + 1;
     }
 
-    if(E.cy < E.rowoff){
-        E.rowoff = E.cy;
+    if(B->cy < B->rowoff){
+        B->rowoff = B->cy;
     }
-    if(E.cy >= E.rowoff + E.screenrows){
-        E.rowoff = E.cy - E.screenrows + 1;
+    if(B->cy >= B->rowoff + E.screenrows){
+        B->rowoff = B->cy - E.screenrows + 1;
     }
-    if(E.rx < E.coloff){
-        E.coloff = E.rx;
+    if(B->rx < B->coloff){
+        B->coloff = B->rx;
     }
-    if(E.rx >= E.coloff + E.screencols){
-        E.coloff = E.rx - E.screencols + 1;
+    if(B->rx >= B->coloff + E.screencols){
+        B->coloff = B->rx - E.screencols + 1;
     }
 }
 
-void editorDrawRows(struct abuf *ab){
+void editorDrawRows(){
     int y;
-    int max_lines = E.numrows;
+    int max_lines = B->numrows;
     int max_digits = max_lines > 0 ? (int)log10(max_lines) + 0 : 0;
     max_digits += 1;
+
+    struct editorSearch *s = &E.search;
+    int overlay = s->len > 0;
+    if(overlay) pthread_mutex_lock(&s->lock);
     
     for(y = 0; y < E.screenrows; y++){
-        int filerow = y + E.rowoff;
+        int filerow = y + B->rowoff;
         
-        if(filerow >= E.numrows){
-            if(E.numrows == 0 && y == E.screenrows/3){
+        if(filerow >= B->numrows){
+            screenPut(y, 0, '~', 0);
+            if(B->numrows == 0 && y == E.screenrows/3){
                 char welcome[80];
                 int welcomelen = snprintf(welcome, sizeof(welcome), "Tuna editor -- version %s", TUNA_VERSION);
                 if(welcomelen > E.screencols) welcomelen = E.screencols;
                 int padding = (E.screencols - welcomelen)/2;
-                if(padding){
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while(padding--) abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
-            }else{
-                abAppend(ab, "~", 1);
+                screenPuts(y, padding, welcome, welcomelen, 0);
             }
         }else{
 	    int line_number = filerow + 1;
 	    char line_number_str[16];
-	    snprintf(line_number_str, sizeof(line_number_str), "%*d ", max_digits, line_number);
-	    abAppend(ab, line_number_str, strlen(line_number_str));
-
-            int len = E.row[filerow].rsize - E.coloff;
-            if(len < 0) len = 0;
-            if(len > E.screencols) len = E.screencols;
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
-            int j;
-            for(j = 0; j < len; j++){
-		if(iscntrl(c[j])){
-		    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-		    abAppend(ab, "\x1b[7m", 4);
-		    abAppend(ab, &sym, 1);
-		    abAppend(ab, "\x1b[m", 3);
-		    if(current_color != -1){
-			char buf[16];
-			int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-			abAppend(ab, buf, clen);
-		    }
-		}else if(hl[j] == HL_NORMAL){
-                    if(current_color != -1){
-                        abAppend(ab, "\x1b[39m", 5);
-                        current_color = -1;
+	    int x = snprintf(line_number_str, sizeof(line_number_str), "%*d ", max_digits, line_number);
+	    screenPuts(y, 0, line_number_str, x, 0);
+
+            erow *row = editorRowRender(filerow);
+            erowCache *cache = row->cache;
+            int col = B->coloff;
+            int stop = cache->rsize;
+            if(stop > B->coloff + E.screencols - x) stop = B->coloff + E.screencols - x;
+
+            /* Syntax spans, with search matches laid over them */
+            int sp = 0, span_start = 0, span_end = 0, span_hl = HL_NORMAL;
+            int k = overlay ? editorSearchRow(s, filerow) : s->n;
+            struct searchCursor start = {0, 0}, end = {0, 0};
+            int match_start = INT_MAX, match_end = 0;
+            while(col < stop){
+                while(match_end <= col && k < s->n && s->m[k].row == filerow){
+                    match_start = editorSearchRx(row, &start, s->m[k].col);
+                    match_end = editorSearchRx(row, &end, s->m[k].col + s->len);
+                    k++;
+                    while(k < s->n && s->m[k].row == filerow && editorSearchRx(row, &start, s->m[k].col) <= match_end){
+                        int rx = editorSearchRx(row, &end, s->m[k].col + s->len);
+                        if(rx > match_end) match_end = rx;
+                        k++;
                     }
-                    abAppend(ab, &c[j], 1);
-                }else{
-                    int color = editorSyntaxToColor(hl[j]);
-                    if(color != current_color){
-                        current_color = color;
-	                char buf[16];
- 	                int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-  	                abAppend(ab, buf, clen);
+                }
+                if(match_end <= col) match_start = INT_MAX;
+                while(span_end <= col){
+                    if(sp == cache->nspan){
+                        span_start = span_end = INT_MAX;
+                        break;
                     }
-                    abAppend(ab, &c[j], 1);
+                    span_start = span_end + cache->span[sp].skip;
+                    span_end = span_start + cache->span[sp].len;
+                    span_hl = cache->span[sp++].hl;
+                }
+
+                int h = HL_NORMAL, next = stop;
+                if(span_start <= col){
+                    h = span_hl;
+                    next = span_end;
+                }else if(span_start < next){
+                    next = span_start;
+                }
+                if(match_start <= col){
+                    h = HL_MATCH;
+                    if(match_end < next) next = match_end;
+                }else if(match_start < next){
+                    next = match_start;
                 }
+                if(next > stop) next = stop;
+
+                screenText(y, x + col - B->coloff, &cache->render[col], next - col, h == HL_NORMAL ? 0 : editorSyntaxToColor(h));
+                col = next;
             }
-            abAppend(ab, "\x1b[39m", 5);
         }
-        abAppend(ab, "\x1b[K", 3);
-        abAppend(ab, "\r\n", 2);
     }
+    if(overlay) pthread_mutex_unlock(&s->lock);
 }
 
-void editorDrawStatusBar(struct abuf *ab){
-    abAppend(ab, "\x1b[7m", 4);
+void editorDrawStatusBar(){
+    int y = E.screenrows;
     char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]", E.numrows, E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->filetype : "no known filetype", E.cy+1, E.numrows);
-    if(len > E.screencols) len = E.screencols;
-    abAppend(ab, status, len);
-    while(len < E.screencols){
-        if(E.screencols - len == rlen){
-            abAppend(ab, rstatus, rlen);
-            break;
-        }else{
-            abAppend(ab, " ", 1);
-            len++;
-        }
+    int len;
+    char loading[24] = "";
+    if(B->load){
+        struct editorLoad *ld = B->load;
+        pthread_mutex_lock(&ld->lock);
+        snprintf(loading, sizeof(loading), " (loading %d%%)", (int)(ld->loaded * 100 / (ld->size ? ld->size : 1)));
+        pthread_mutex_unlock(&ld->lock);
     }
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    if(E.nbuffers > 1)
+        len = snprintf(status, sizeof(status), "[%d/%d] %.20s - %d lines%s %s", bufferIndex(B) + 1, E.nbuffers, B->filename ? B->filename : "[No Name]", B->numrows, loading, B->dirty ? "(modified)" : "");
+    else
+        len = snprintf(status, sizeof(status), "%.20s - %d lines%s %s", B->filename ? B->filename : "[No Name]", B->numrows, loading, B->dirty ? "(modified)" : "");
+    int rlen;
+    struct editorSearch *s = &E.search;
+    if(s->len > 0){
+        pthread_mutex_lock(&s->lock);
+        const char *more = s->done && !s->capped ? "" : "+";
+        if(s->current >= 0)
+            rlen = snprintf(rstatus, sizeof(rstatus), "match %d of %d%s | %d/%d", s->current + 1, s->n, more, B->cy+1, B->numrows);
+        else
+            rlen = snprintf(rstatus, sizeof(rstatus), "%d%s matches | %d/%d", s->n, more, B->cy+1, B->numrows);
+        pthread_mutex_unlock(&s->lock);
+    }else{
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", B->syntax ? B->syntax->filetype : "no known filetype", B->cy+1, B->numrows);
+    }
+    if(E.stats.overlay){
+        statHist *h = &E.stats.latency;
+        rlen = snprintf(rstatus, sizeof(rstatus), "paint p50 %.2f p99 %.2f ms",
+                        statPercentile(h, 0.5) / 1000.0, statPercentile(h, 0.99) / 1000.0);
+    }
+    if(len > E.screencols) len = E.screencols;
+    for(int x = 0; x < E.screencols; x++) screenPut(y, x, ' ', SCREEN_INVERSE);
+    screenPuts(y, 0, status, len, SCREEN_INVERSE);
+    if(E.screencols - len >= rlen) screenPuts(y, E.screencols - rlen, rstatus, rlen, SCREEN_INVERSE);
 }
 
-void editorDrawMessageBar(struct abuf *ab){
-    abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar(){
     int msglen = strlen(E.statusmsg);
     if(msglen>E.screencols) msglen = E.screencols;
-    if(msglen && time(NULL) - E.statusmsg_time < 5)
-        abAppend(ab, E.statusmsg, msglen);
+    if(msglen && time(NULL) - E.statusmsg_time < TUNA_STATUS_SECS)
+        screenPuts(E.screenrows + 1, 0, E.statusmsg, msglen, 0);
 }
 
 void editorRefreshScreen(){
+    struct editorStats *st = &E.stats;
+    long long start = editorClockUs();
+    int allocs = E.screen.allocs;
     editorScroll();
 
-    struct abuf ab = ABUF_INIT;
+    screenResize();
+    screenBlank(E.screen.cur, E.screen.rows * E.screen.cols);
+    long long t = editorClockUs();
+    editorDrawRows();
+    statAdd(&st->draw, editorClockUs() - t);
+    traceSpan("render", "editorDrawRows", t, NULL, 0);
+    editorDrawStatusBar();
+    editorDrawMessageBar();
 
-    abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3);
-
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
-
-    int max_lines = E.numrows;
+    int max_lines = B->numrows;
     int max_digits = max_lines > 0 ? (int)log10(max_lines) + 1 : 1;
     int line_number_width = max_digits + 1;
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + line_number_width + 1);
-    abAppend(&ab, buf, strlen(buf));
-
-    abAppend(&ab, "\x1b[?25h", 6);
-
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    static struct abuf ab = ABUF_INIT;
+    ab.len = 0;
+    editorScreenFlush(&ab, B->cy - B->rowoff, (B->rx - B->coloff) + line_number_width);
+    if(ab.len){
+        t = editorClockUs();
+        write(STDOUT_FILENO, ab.b, ab.len);
+        statAdd(&st->write, editorClockUs() - t);
+    }
+    E.screen.frame_allocs = E.screen.allocs - allocs;
+    E.screen.frame_bytes = ab.len;
+
+    long long end = editorClockUs();
+    statAdd(&st->frame, end - start);
+    traceSpan("render", "editorRefreshScreen", start, "bytes", ab.len);
+    st->frames++;
+    st->bytes += ab.len;
+    if(st->key_at){
+        statAdd(&st->latency, end - st->key_at);
+        st->key_at = 0;
+    }
 }
 
 void editorSetStatusMessage(const char *fmt, ...){
@@ -1178,6 +4999,16 @@ char *editorPrompt(char * prompt, void (*callback)(char *, int)){
                 if(callback) callback(buf, c);
                 return buf;
             }
+        }else if(c == PASTE_KEY){
+            for(int i = 0; i < input_paste_len; i++){
+                if(iscntrl((unsigned char)input_paste[i])) continue;
+                if(buflen == bufsize - 1){
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                buf[buflen++] = input_paste[i];
+            }
+            buf[buflen] = '\0';
         }else if(!iscntrl(c) && c < 128){
             if(buflen == bufsize - 1){
                 bufsize  *= 2;
@@ -1191,72 +5022,78 @@ char *editorPrompt(char * prompt, void (*callback)(char *, int)){
 }
 
 void editorMoveCursor(int key){
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    if(key == ARROW_DOWN || key == ARROW_RIGHT) editorLoadWait(B->cy + 1);
+    erow *row = (B->cy >= B->numrows) ? NULL : editorRowAt(B->cy);
 
-    int line_number_width = (int)log10(E.numrows) + 2;
+    int line_number_width = (int)log10(B->numrows) + 2;
     int max_columns = E.screencols - line_number_width;
 
     switch(key){
         case ARROW_LEFT:
-            if(E.cx > 0){
-                E.cx--;
-            }else if(E.cy > 0){
-                E.cy--;
-                E.cx = E.row[E.cy].size;
+            if(B->cx > 0){
+                B->cx--;
+            }else if(B->cy > 0){
+                B->cy--;
+                B->cx = editorRowAt(B->cy)->size;
             }
             break;
         case ARROW_RIGHT:
-            if(row && E.cx < row->size){
-                E.cx++;
-            }else if(row && E.cx == row->size){
-                E.cy++;
-                E.cx = 0;
+            if(row && B->cx < row->size){
+                B->cx++;
+            }else if(row && B->cx == row->size){
+                B->cy++;
+                B->cx = 0;
             }
             break;
         case ARROW_UP:
-            if(E.cy > 0){
-                E.cy--;
+            if(B->cy > 0){
+                B->cy--;
             }
             break;
         case ARROW_DOWN:
-            if(E.cy < E.numrows){
-                E.cy++;
+            if(B->cy < B->numrows){
+                B->cy++;
             }
             break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = (B->cy >= B->numrows) ? NULL : editorRowAt(B->cy);
     int rowlen = row ? row->size : 0;
-    if(E.cx > rowlen){
-        E.cx = rowlen;
+    if(B->cx > rowlen){
+        B->cx = rowlen;
     }
 
-    if(E.cx + line_number_width > max_columns){
-        E.cx = max_columns - line_number_width;
+    if(B->cx + line_number_width > max_columns){
+        B->cx = max_columns - line_number_width;
     }
 }
 
 void editorMoveSelection(int key){
     switch(key){
 	case ARROW_LEFT:
-	    if(E.cx > 0) E.cx--;
+	    if(B->cx > 0) B->cx--;
 	    break;
 	case ARROW_RIGHT:
-	    if(E.cx < E.row[E.cy].size) E.cx++;
+	    if(B->cx < editorRowAt(B->cy)->size) B->cx++;
 	    break;
 	case ARROW_UP:
-	    if(E.cy > 0) E.cy--;
+	    if(B->cy > 0) B->cy--;
 	    break;
 	case ARROW_DOWN:
-	    if(E.cy < E.numrows - 1) E.cy++;
+	    if(B->cy < B->numrows - 1) B->cy++;
 	    break;
     }
-    // sel.end_row = E.cy;
-    // sel.end_col = E.cx;
+    // sel.end_row = B->cy;
+    // sel.end_col = B->cx;
 }
 
 //#define CTRL_SPACE 32
 
+static void editorKeyDone(){
+    E.stats.keys++;
+    statAdd(&E.stats.keypress, editorClockUs() - E.stats.key_start);
+}
+
 void editorProcessKeypress(){
     static int quit_times = TUNA_QUIT_TIMES;
     int c = editorReadKey();
@@ -1267,10 +5104,22 @@ void editorProcessKeypress(){
             break;
 
         case CTRL_KEY('q'):
-            if(E.dirty && quit_times > 0){
-                editorSetStatusMessage("WARNING!!! File has unsaved changes. Press ctrl-Q %d more times to quit.", quit_times);
-                quit_times--;
-                return;
+            {
+                int unsaved = 0;
+                for(int i = 0; i < E.nbuffers; i++) unsaved += E.buffers[i]->dirty != 0;
+                if(unsaved && quit_times > 0){
+                    if(unsaved == 1 && B->dirty)
+                        editorSetStatusMessage("WARNING!!! File has unsaved changes. Press ctrl-Q %d more times to quit.", quit_times);
+                    else
+                        editorSetStatusMessage("WARNING!!! %d buffers have unsaved changes. Press ctrl-Q %d more times to quit.", unsaved, quit_times);
+                    quit_times--;
+                    editorKeyDone();
+                    return;
+                }
+            }
+            for(int i = 0; i < E.nbuffers; i++){
+                B = E.buffers[i];
+                journalDiscard();
             }
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
@@ -1282,13 +5131,25 @@ void editorProcessKeypress(){
             break;
 
 		case CTRL_KEY('o'): // Opening
-			if(E.dirty){
-				editorSetStatusMessage("Unsaved Changes! Save (CTRL-S) before opening another file.");
-				return;
-			}
 			editorOpenFileMenu();
 			break;
 
+		case CTRL_KEY('n'): // Buffers
+			editorBufferNext(1);
+			break;
+
+		case CTRL_KEY('p'):
+			editorBufferNext(-1);
+			break;
+
+		case CTRL_KEY('b'):
+			editorBufferList();
+			break;
+
+		case CTRL_KEY('w'):
+			editorBufferClose();
+			break;
+
 		case CTRL_KEY('t'):	// Title change
 			editorChangeTitle();
 			break;
@@ -1298,18 +5159,33 @@ void editorProcessKeypress(){
 			break;
 
         case HOME_KEY:
-            E.cx = 0;
+            B->cx = 0;
             break;
 
         case END_KEY:
-            if(E.cy < E.numrows)
-                E.cx = E.row[E.cy].size;
+            if(B->cy < B->numrows)
+                B->cx = editorRowAt(B->cy)->size;
             break;
 
         case CTRL_KEY('f'):
             editorFind();
             break;
 
+        case PASTE_KEY:
+            if(editorPaste(input_paste, input_paste_len)){
+                input_paste = NULL;
+                input_paste_cap = 0;
+            }
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
+
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
@@ -1321,10 +5197,11 @@ void editorProcessKeypress(){
         case PAGE_DOWN:
             {
                 if(c == PAGE_UP){
-                    E.cy = E.rowoff;
+                    B->cy = B->rowoff;
                 }else if(c == PAGE_DOWN){
-                    E.cy = E.rowoff + E.screenrows - 1;
-                    if(E.cy > E.numrows) E.cy = E.numrows;
+                    editorLoadWait(B->rowoff + 2 * E.screenrows);
+                    B->cy = B->rowoff + E.screenrows - 1;
+                    if(B->cy > B->numrows) B->cy = B->numrows;
                 }
 
                 int times = E.screenrows;
@@ -1340,6 +5217,22 @@ void editorProcessKeypress(){
             break;
 
         case CTRL_KEY('l'):
+            editorSetStatusMessage("Last frame: %d bytes, %d allocations", E.screen.frame_bytes, E.screen.frame_allocs);
+            editorScreenInvalidate();
+            break;
+
+        case CTRL_KEY('g'): // Latency overlay
+            E.stats.overlay = !E.stats.overlay;
+            break;
+
+        case CTRL_KEY('d'):
+            editorStatsDump();
+            if(E.trace.ring){
+                traceFlush();
+                editorSetStatusMessage("Stats written to %s, trace to %s", TUNA_STATS_FILE, E.trace.path);
+            }
+            break;
+
         case '\x1b':
             break;
 
@@ -1348,41 +5241,549 @@ void editorProcessKeypress(){
             break;
     }
     quit_times = TUNA_QUIT_TIMES;
+    editorKeyDone();
+}
+
+/* Batch */
+
+/*
+ * tuna --batch SCRIPT FILE applies a script to FILE without a terminal.
+ * One command per line, blank lines and lines starting with # ignored:
+ *
+ *     goto N|$            make line N (1-based) or the last line current
+ *     find TEXT           move to the next line after this one containing TEXT
+ *     insert TEXT         add TEXT as lines before the current line
+ *     append TEXT         add TEXT as lines after it, and move to the last one
+ *     delete [N]          delete N lines (default 1) from the current line on
+ *     replace/OLD/NEW/[g] replace the first (g: every) OLD on each line
+ *     save [PATH]         write the buffer to FILE, or to PATH
+ *
+ * TEXT understands \n, \t and \\. Edits go straight to the row store, with
+ * no undo, journal or rendering, and only as much of the file is waited
+ * for as each command needs, so the untouched rows of a big file stay
+ * mapped. Text is matched literally. A failing command stops the script.
+ */
+
+static const char *batch_script;
+static int batch_line;
+
+static void batchFail(const char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "tuna: %s:%d: ", batch_script, batch_line);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(1);
+}
+
+/* Decodes escapes in place, stopping at an unescaped delim; returns the length. */
+static int batchUnescape(char *s, int delim, char **end){
+    int len = 0;
+    char *p = s;
+    while(*p && *p != delim){
+        char c = *p++;
+        if(c == '\\' && *p){
+            c = *p++;
+            if(c == 'n') c = '\n';
+            else if(c == 't') c = '\t';
+        }
+        s[len++] = c;
+    }
+    if(end) *end = p;
+    return len;
+}
+
+static int batchRowExists(int at){
+    if(at >= B->numrows) editorLoadWait(at);
+    return at < B->numrows;
+}
+
+/* Reads rows in order without materializing their leaves. */
+struct batchCursor{
+    rowLeaf *leaf;
+    int off;
+    int at;
+};
+
+static int batchSeek(struct batchCursor *c, int at){
+    if(!batchRowExists(at)) return 0;
+    rowLeaf *last = B->cache_leaf;     /* where the last edit landed */
+    if(last && at >= B->cache_start && at < B->cache_start + last->h.n){
+        c->leaf = last;
+        c->off = at - B->cache_start;
+    }else{
+        c->leaf = rowStoreSeek(at, &c->off);
+    }
+    c->at = at;
+    return 1;
+}
+
+static int batchNext(struct batchCursor *c){
+    c->at++;
+    if(++c->off < c->leaf->h.n) return 1;
+    if(c->leaf->next == NULL) return batchSeek(c, c->at);
+    c->leaf = c->leaf->next;
+    c->off = 0;
+    return 1;
+}
+
+/* Inserts text split on '\n' as rows from at on; returns the row count. */
+static int batchInsertRows(int at, char *text, int len){
+    int rows = 0, start = 0;
+    for(int i = 0; i <= len; i++){
+        if(i < len && text[i] != '\n') continue;
+        editorInsertRow(at + rows++, &text[start], i - start);
+        start = i + 1;
+    }
+    return rows;
+}
+
+static void batchReplace(char *arg){
+    int delim = (unsigned char)*arg;
+    if(delim == '\0' || isalnum(delim) || isspace(delim)) batchFail("replace needs a delimiter, as in replace/old/new/");
+    char *old = arg + 1, *p;
+    int old_len = batchUnescape(old, delim, &p);
+    if(*p != delim) batchFail("unterminated replace");
+    char *new = p + 1;
+    int new_len = batchUnescape(new, delim, &p);
+    if(*p != delim) batchFail("unterminated replace");
+    int global = p[1] == 'g';
+    if(old_len == 0) batchFail("nothing to replace");
+
+    struct batchCursor c;
+    for(int ok = batchSeek(&c, 0); ok; ok = batchNext(&c)){
+        int len, col = 0;
+        char *text = rowStoreLine(c.leaf, c.off, &len);
+        char *hit;
+        if(len < old_len || (hit = memmem(text, len, old, old_len)) == NULL) continue;
+        do{
+            editorDeleteText(c.at, hit - text, old_len);
+            B->cy = c.at;
+            B->cx = hit - text;
+            editorInsertText(new, new_len);
+            batchSeek(&c, B->cy);
+            col = B->cx;
+            text = rowStoreLine(c.leaf, c.off, &len);
+        }while(global && col <= len - old_len && (hit = memmem(text + col, len - col, old, old_len)) != NULL);
+    }
+}
+
+static void batchCommand(char *line){
+    char *arg = line;
+    while(*arg && !isspace((unsigned char)*arg) && *arg != '/') arg++;
+    int cmd_len = arg - line;
+    if(*arg && *arg != '/') arg++;
+    #define CMD(name) (cmd_len == (int)strlen(name) && !strncmp(line, name, cmd_len))
+
+    if(CMD("goto")){
+        if(!strcmp(arg, "$")){
+            editorLoadWait(INT_MAX);
+            B->cy = B->numrows > 0 ? B->numrows - 1 : 0;
+        }else{
+            char *end;
+            long n = strtol(arg, &end, 10);
+            if(end == arg || *end || n < 1) batchFail("bad line number '%s'", arg);
+            if(!batchRowExists(n - 1)) batchFail("line %ld is past the end (%d lines)", n, B->numrows);
+            B->cy = n - 1;
+        }
+    }else if(CMD("find")){
+        int len = batchUnescape(arg, '\0', NULL);
+        struct batchCursor c;
+        int ok;
+        for(ok = batchSeek(&c, B->cy + 1); ok; ok = batchNext(&c)){
+            int rlen;
+            char *text = rowStoreLine(c.leaf, c.off, &rlen);
+            if(memmem(text, rlen, arg, len)) break;
+        }
+        if(!ok) batchFail("'%.*s' not found", len, arg);
+        B->cy = c.at;
+    }else if(CMD("insert") || CMD("append")){
+        int len = batchUnescape(arg, '\0', NULL);
+        int append = CMD("append");
+        int at = B->cy;
+        if(append && batchRowExists(at)) at++;
+        if(at > B->numrows) at = B->numrows;
+        int rows = batchInsertRows(at, arg, len);
+        B->cy = append ? at + rows - 1 : at + rows;
+    }else if(CMD("delete")){
+        char *end;
+        long n = *arg ? strtol(arg, &end, 10) : 1;
+        if(*arg && (end == arg || *end || n < 1)) batchFail("bad line count '%s'", arg);
+        if(n > INT_MAX - B->cy) n = INT_MAX - B->cy;
+        batchRowExists(B->cy + n - 1);
+        for(long i = 0; i < n && B->cy < B->numrows; i++) editorDelRow(B->cy);
+    }else if(CMD("replace")){
+        int cy = B->cy;
+        batchReplace(arg);
+        B->cy = cy;
+    }else if(CMD("save")){
+        editorLoadWait(INT_MAX);
+        editorGapClose();
+        long long written;
+        const char *path = *arg ? arg : B->filename;
+        if(editorSaveFile(path, &written) == -1) batchFail("can't save %s: %s", path, strerror(errno));
+        if(path == B->filename) B->dirty = 0;
+    }else{
+        batchFail("unknown command '%.*s'", cmd_len, line);
+    }
+    #undef CMD
+}
+
+int editorBatch(const char *script, const char *filename){
+    batch_script = script;
+    FILE *fp = strcmp(script, "-") ? fopen(script, "r") : stdin;
+    if(!fp){
+        fprintf(stderr, "tuna: %s: %s\n", script, strerror(errno));
+        return 1;
+    }
+
+    E.batch = 1;
+    initEditor();
+    editorOpen(filename);
+    if(B->filename == NULL){
+        fprintf(stderr, "tuna: %s: %s\n", filename, E.statusmsg);
+        return 1;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while((len = getline(&line, &cap, fp)) != -1){
+        batch_line++;
+        while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+        char *cmd = line;
+        while(isspace((unsigned char)*cmd)) cmd++;
+        if(*cmd == '\0' || *cmd == '#') continue;
+        batchCommand(cmd);
+    }
+    free(line);
+    if(fp != stdin) fclose(fp);
+    return 0;
 }
 
 /* Init bruv */
 
 void initEditor(){
-    E.cx = 0;
-    E.cy = 0;
-    E.rx = 0;
-    E.rowoff = 0;
-    E.coloff = 0;
-    E.numrows = 0;
-    E.row = NULL;
-    E.dirty = 0;
-    E.filename = NULL;
+    E.buffers = NULL;
+    E.nbuffers = 0;
+    E.tick = 0;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
-    E.syntax = NULL;
-
-    if(getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
-    E.screenrows -= 2;
+    pthread_mutex_init(&E.search.lock, NULL);
+    pthread_cond_init(&E.search.more, NULL);
+    screenInitSGR();
+    editorInitEvents();
+    editorStatsInit();
+    traceInit();
+    E.search.current = -1;
+    bufferSwitch(bufferNew());
 }
 
+#ifndef TUNA_BENCH
 int main(int argc, char *argv[]){
+    if(argc >= 2 && !strcmp(argv[1], "--batch")){
+        if(argc != 4){
+            fprintf(stderr, "usage: %s --batch SCRIPT FILE\n", argv[0]);
+            return 1;
+        }
+        return editorBatch(argv[2], argv[3]);
+    }
     enableRawMode();
     initEditor();
+    if(getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+    E.screenrows -= 2;
     if(argc >= 2){
         editorOpen(argv[1]);
     }
 
-    editorSetStatusMessage("HELP: Ctrl + (S)ave | (Q)uit | (F)ind | (O)pen | (T)itle | (U)Terminal");
+    if(E.statusmsg[0] == '\0') editorSetStatusMessage("HELP: Ctrl + (S)ave | (Q)uit | (F)ind | (O)pen | (T)itle | (U)Terminal");
 
+    /* Draw at most once per frame: keys that arrive within TUNA_FRAME_MS
+     * of the last draw are handled before the next one. */
     while(1){
         editorRefreshScreen();
+        long long frame = editorClockMs();
         editorProcessKeypress();
+        while(1){
+            if(editorInputPending()){
+                editorProcessKeypress();
+                continue;
+            }
+            long long left = frame + TUNA_FRAME_MS - editorClockMs();
+            if(left <= 0 || !(editorWait(left) & WAIT_INPUT)) break;
+            editorProcessKeypress();
+        }
     }
     
     return 0;
 }
+#endif
+
+/* Bench */
+
+/*
+ * A headless build for timing the editor core:
+ *
+ *     cc -O2 -DTUNA_BENCH -o tuna-bench tuna.c -lpthread -lm
+ *     ./tuna-bench [-m MB] [-n samples] [lines|long|tabs|c|asm ...]
+ *
+ * Each profile writes a synthetic file, then opens, edits, redraws,
+ * searches and saves it through the same functions the keys call. Stdout
+ * is pointed at /dev/null and stands in for the terminal, so every frame
+ * is still built, diffed and written; the report goes to the real stdout.
+ */
+#ifdef TUNA_BENCH
+
+struct benchStat{
+    const char *op;
+    long long *us;
+    int n;
+    int cap;
+    long long bytes;
+};
+
+static FILE *bench_out;
+
+static void benchAdd(struct benchStat *st, long long us){
+    if(st->n == st->cap){
+        st->cap = st->cap ? st->cap * 2 : 256;
+        st->us = realloc(st->us, sizeof(long long) * st->cap);
+        if(st->us == NULL) die("realloc");
+    }
+    st->us[st->n++] = us;
+}
+
+static int benchCompare(const void *a, const void *b){
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static void benchReport(const char *profile, struct benchStat *st){
+    if(st->n == 0) return;
+    long long total = 0;
+    for(int i = 0; i < st->n; i++) total += st->us[i];
+    qsort(st->us, st->n, sizeof(long long), benchCompare);
+    long long p50 = st->us[st->n / 2];
+    long long p99 = st->us[(st->n * 99) / 100 < st->n ? (st->n * 99) / 100 : st->n - 1];
+    fprintf(bench_out, "%-6s %-10s %6d  p50 %9.3f ms  p99 %9.3f ms  max %9.3f ms  ",
+            profile, st->op, st->n, p50 / 1000.0, p99 / 1000.0, st->us[st->n - 1] / 1000.0);
+    if(total == 0) total = 1;
+    if(st->bytes) fprintf(bench_out, "%9.1f MB/s\n", (double)st->bytes / total * 1000000.0 / (1 << 20));
+    else fprintf(bench_out, "%9.0f ops/s\n", (double)st->n / total * 1000000.0);
+    free(st->us);
+    st->us = NULL;
+    st->n = st->cap = 0;
+    st->bytes = 0;
+}
+
+static const char *bench_words[] = {
+    "buffer", "row", "render", "static", "int", "while", "return", "cursor", "screen", "leaf",
+    "syntax", "comment", "char", "size", "struct", "search", "query", "match", "void", "if"
+};
+#define BENCH_WORDS (sizeof(bench_words) / sizeof(bench_words[0]))
+
+static const char *bench_regs[] = {"rax", "rbx", "rcx", "rdx", "rsi", "rdi", "r8", "r9", "xmm0", "eax"};
+static const char *bench_ops[] = {"mov", "add", "sub", "xor", "cmp", "lea", "push", "pop", "call", "jne"};
+
+/* Writes about size bytes of the profile's kind of text to path. */
+static int benchGenerate(const char *path, const char *profile, size_t size){
+    FILE *fp = fopen(path, "w");
+    if(!fp) return -1;
+    srand(1);
+    size_t written = 0;
+    for(int i = 0; written < size; i++){
+        const char *w = bench_words[rand() % BENCH_WORDS];
+        int len = 0;
+        if(!strcmp(profile, "lines")){
+            len = fprintf(fp, "%s %s %d %s\n", w, bench_words[i % BENCH_WORDS], rand(), w);
+        }else if(!strcmp(profile, "long")){
+            for(int j = 0; j < 20000; j++) len += fprintf(fp, "%s ", bench_words[rand() % BENCH_WORDS]);
+            len += fprintf(fp, "\n");
+        }else if(!strcmp(profile, "tabs")){
+            for(int j = rand() % 6; j >= 0; j--) len += fprintf(fp, "\t");
+            len += fprintf(fp, "%s\t%d\t\t%s\t%s\n", w, rand() % 1000, bench_words[i % BENCH_WORDS], w);
+        }else if(!strcmp(profile, "c")){
+            if(i % 40 == 0) len = fprintf(fp, "/*\n * %s %s, block %d\n */\n", w, w, i);
+            else if(i % 7 == 0) len = fprintf(fp, "    // %s the %s\n", w, bench_words[i % BENCH_WORDS]);
+            else if(i % 5 == 0) len = fprintf(fp, "    char *%s_%d = \"%s /* not a comment */\";\n", w, i, w);
+            else len = fprintf(fp, "    if(%s_%d > %d) return %s(%d); /* %s */\n", w, i, rand() % 100, w, i, w);
+        }else if(!strcmp(profile, "asm")){
+            if(i % 16 == 0) len = fprintf(fp, "%s_%d:\n", w, i);
+            else len = fprintf(fp, "    %s %s, %s    ; %s\n", bench_ops[rand() % 10], bench_regs[rand() % 10],
+                               bench_regs[rand() % 10], w);
+        }else{
+            fclose(fp);
+            return -1;
+        }
+        written += len;
+    }
+    fclose(fp);
+    return 0;
+}
+
+static long long benchFileSize(const char *path){
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : 0;
+}
+
+static void benchClose(){
+    B->dirty = 0;
+    editorBufferClose();
+}
+
+static void benchProfile(const char *dir, const char *profile, size_t size, int samples){
+    const char *ext = !strcmp(profile, "c") ? ".c" : !strcmp(profile, "asm") ? ".asm" : ".txt";
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/bench-%s%s", dir, profile, ext);
+    if(benchGenerate(path, profile, size) == -1){
+        fprintf(bench_out, "%-6s unknown profile\n", profile);
+        return;
+    }
+    long long bytes = benchFileSize(path);
+    struct benchStat st = {0};
+    long long t;
+
+    /* Opening: to the first frame, then until every row is in */
+    struct benchStat load = {"load", NULL, 0, 0, 0};
+    st.op = "open";
+    for(int i = 0; i < 5; i++){
+        if(i) benchClose();
+        t = editorClockUs();
+        editorOpen(path);
+        editorRefreshScreen();
+        benchAdd(&st, editorClockUs() - t);
+        editorLoadWait(INT_MAX);
+        while(editorLoadPoll());
+        benchAdd(&load, editorClockUs() - t);
+        load.bytes += bytes;
+    }
+    benchReport(profile, &st);
+    benchReport(profile, &load);
+
+    if(B->syntax){
+        st.op = "highlight";
+        t = editorClockUs();
+        editorSyntaxSync(B->numrows);
+        benchAdd(&st, editorClockUs() - t);
+        st.bytes = bytes;
+        benchReport(profile, &st);
+    }
+
+    /* Full redraws at random places in the file */
+    st.op = "redraw";
+    long long frame_bytes = 0;
+    for(int i = 0; i < samples; i++){
+        B->cy = B->rowoff = B->numrows ? rand() % B->numrows : 0;
+        B->cx = 0;
+        t = editorClockUs();
+        editorScreenInvalidate();
+        editorRefreshScreen();
+        benchAdd(&st, editorClockUs() - t);
+        frame_bytes += E.screen.frame_bytes;
+    }
+    benchReport(profile, &st);
+    fprintf(bench_out, "%-6s %-10s %6lld bytes per frame\n", profile, "frame", frame_bytes / (samples ? samples : 1));
+
+    /* A typing burst in the middle of the file, each key painted */
+    st.op = "type";
+    B->cy = B->numrows / 2;
+    B->cx = 0;
+    editorRefreshScreen();
+    for(int i = 0; i < samples; i++){
+        t = editorClockUs();
+        editorInsertChar(i % 10 == 9 ? ' ' : 'a' + i % 26);
+        editorRefreshScreen();
+        benchAdd(&st, editorClockUs() - t);
+    }
+    benchReport(profile, &st);
+
+    st.op = "newline";
+    B->cy = B->cx = 0;
+    editorRefreshScreen();
+    for(int i = 0; i < samples; i++){
+        B->cy = B->cx = 0;
+        t = editorClockUs();
+        editorInsertNewLine();
+        editorRefreshScreen();
+        benchAdd(&st, editorClockUs() - t);
+    }
+    benchReport(profile, &st);
+
+    /* Search: the whole file for a common word */
+    struct benchStat first = {"find-first", NULL, 0, 0, 0};
+    st.op = "find";
+    for(int i = 0; i < 5; i++){
+        editorSearchReset(&E.search);
+        t = editorClockUs();
+        editorSearchStart(&E.search, "struct", 0, 0);
+        int seen = 0;
+        while(E.search.running){
+            if(editorSearchPoll(&E.search) && !seen++) benchAdd(&first, editorClockUs() - t);
+            if(E.search.running) usleep(50);
+        }
+        benchAdd(&st, editorClockUs() - t);
+        st.bytes += bytes;
+    }
+    editorSearchReset(&E.search);
+    benchReport(profile, &first);
+    benchReport(profile, &st);
+
+    st.op = "save";
+    for(int i = 0; i < 3; i++){
+        t = editorClockUs();
+        editorSave();
+        editorSaveWait();
+        benchAdd(&st, editorClockUs() - t);
+        st.bytes += benchFileSize(path);
+    }
+    benchReport(profile, &st);
+
+    benchClose();
+    unlink(path);
+}
+
+int main(int argc, char *argv[]){
+    size_t size = 16 << 20;
+    int samples = 1000;
+    int i = 1;
+    for(; i < argc && argv[i][0] == '-'; i++){
+        if(!strcmp(argv[i], "-m") && i + 1 < argc) size = (size_t)atoi(argv[++i]) << 20;
+        else if(!strcmp(argv[i], "-n") && i + 1 < argc) samples = atoi(argv[++i]);
+        else{
+            fprintf(stderr, "usage: %s [-m MB] [-n samples] [lines|long|tabs|c|asm ...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    /* The fake terminal: frames are written to /dev/null */
+    int out = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if(out == -1 || null == -1 || dup2(null, STDOUT_FILENO) == -1) die("dup");
+    close(null);
+    bench_out = fdopen(out, "w");
+    setvbuf(bench_out, NULL, _IOLBF, 0);
+
+    initEditor();
+    E.screenrows = 48;
+    E.screencols = 160;
+
+    char dir[PATH_MAX];
+    const char *tmp = getenv("TMPDIR");
+    snprintf(dir, sizeof(dir), "%s/tuna-bench.XXXXXX", tmp ? tmp : "/tmp");
+    if(mkdtemp(dir) == NULL) die("mkdtemp");
+
+    fprintf(bench_out, "tuna-bench %s: %zu MB per profile, %d samples, %dx%d screen, %d lex threads\n",
+            TUNA_VERSION, size >> 20, samples, E.screencols, E.screenrows, editorLexThreads());
+    static const char *all[] = {"lines", "long", "tabs", "c", "asm"};
+    if(i == argc){
+        for(unsigned int j = 0; j < sizeof(all) / sizeof(all[0]); j++) benchProfile(dir, all[j], size, samples);
+    }else{
+        for(; i < argc; i++) benchProfile(dir, argv[i], size, samples);
+    }
+
+    rmdir(dir);
+    return 0;
+}
+
+#endif